@@ -0,0 +1,315 @@
+// Microbenchmarks of the rules engine hot paths on fixed-seed positions
+// for 9x9, 13x13 and 19x19 boards. Reports time and heap allocations per
+// call, --json prints the same numbers in a machine-readable form.
+// --check-allocations runs every benchmark once and fails if any of them
+// allocated, make runs it after building.
+//
+//   ./game_logic_bench [--json | --check-allocations] [seconds per benchmark]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+#include "game_logic.h"
+#include "playout.h"
+
+// every heap allocation in the process goes through here
+static long allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// positions sampled from random games, each one with the moves that can
+// be tried from it
+#define POSITIONS 16
+#define MAX_MOVES 64
+
+struct Position {
+    GameData game;
+    int quiet_count;
+    int capture_count;
+    v2 quiet[MAX_MOVES];
+    v2 captures[MAX_MOVES];
+};
+
+struct BenchData {
+    int size;
+    Position positions[POSITIONS];
+    // a finished random game, scored with winner and walked back and
+    // forth with undo_move and redo_move
+    GameData finished;
+    // black just took a ko, white may not retake it
+    GameData ko;
+    v2 ko_point;
+    // every group of every position, those of position p are numbers
+    // group_begin[p] up to group_begin[p+1]
+    int group_begin[POSITIONS+1];
+    int group_sizes[POSITIONS * MAX_BOARD_POINTS];
+    v2 *groups[POSITIONS * MAX_BOARD_POINTS];
+    v2 group_stones[POSITIONS * MAX_BOARD_POINTS];
+};
+
+static void setup(BenchData *data, int size) {
+    static GameData probe;
+    uint64_t rng = 0x676f62656e6368 + size;
+    data->size = size;
+    int group_count = 0, stone_count = 0;
+
+    // positions from a few moves in up to a well filled board
+    for(int p = 0; p < POSITIONS; p++) {
+        Position *pos = &data->positions[p];
+        GameData *game = &pos->game;
+        *game = {};
+        game->board.size = size;
+        int moves = (p+1) * size * size / (POSITIONS+4);
+        for(int m = 0; m < moves; m++)
+            play_random_move(game, &rng);
+
+        pos->quiet_count = pos->capture_count = 0;
+        Bitboard legal = game->legal_moves();
+        for(int k = legal.first(); k != -1; k = legal.first()) {
+            legal.reset(k);
+            v2 v = game->board.point(k);
+            probe = *game;
+            bool ok = probe.maybe_make_move(v.x, v.y);
+            if(!ok) continue;
+            if(probe.log.removed_count[probe.log.move_count-1] > 0) {
+                if(pos->capture_count < MAX_MOVES) pos->captures[pos->capture_count++] = v;
+            } else {
+                if(pos->quiet_count < MAX_MOVES) pos->quiet[pos->quiet_count++] = v;
+            }
+        }
+
+        data->group_begin[p] = group_count;
+        bool seen[19][19] = {};
+        for(int i = 0; i < size; i++) {
+            for(int j = 0; j < size; j++) {
+                if(seen[i][j] || game->board.stone(i, j) == STONE_NONE) continue;
+                v2 *group = &data->group_stones[stone_count];
+                int n = game->board.get_group(i, j, group);
+                for(int it = 0; it < n; it++)
+                    seen[group[it].x][group[it].y] = true;
+                data->groups[group_count] = group;
+                data->group_sizes[group_count++] = n;
+                stone_count += n;
+            }
+        }
+    }
+    data->group_begin[POSITIONS] = group_count;
+
+    data->finished = {};
+    data->finished.board.size = size;
+    playout(&data->finished, &rng);
+
+    // top left corner:  . B W .
+    //                   B . B W
+    //                   . B W .
+    v2 ko_moves[] = {
+        {0, 1}, {0, 2}, {1, 0}, {2, 2}, {2, 1}, {1, 3},
+        {size-1, size-1}, {1, 1}, {1, 2},
+    };
+    data->ko = {};
+    data->ko.board.size = size;
+    for(v2 v : ko_moves) {
+        bool ok = data->ko.maybe_make_move(v.x, v.y);
+        if(!ok) abort();
+    }
+    data->ko_point = {1, 1};
+}
+
+struct Result {
+    const char *name;
+    int size;
+    long ops;
+    double ns_per_op;
+    double allocations_per_op;
+};
+
+#define MAX_RESULTS 64
+static Result results[MAX_RESULTS];
+static int result_count = 0;
+
+static long sink = 0;
+// time spent inside a benchmark on setting up its next round
+static double seconds_excluded = 0;
+
+// runs fn over and over for at least the given time, one call does ops
+// operations
+template <typename F>
+static void run(const char *name, int size, double seconds, F fn) {
+    fn(); // warm up
+    long ops = 0;
+    long allocations_before = allocations;
+    seconds_excluded = 0;
+    double start = now(), elapsed = 0;
+    do {
+        ops += fn();
+        elapsed = now() - start - seconds_excluded;
+    } while(elapsed < seconds);
+
+    Result *r = &results[result_count++];
+    r->name = name;
+    r->size = size;
+    r->ops = ops;
+    r->ns_per_op = elapsed * 1e9 / ops;
+    r->allocations_per_op = (double)(allocations - allocations_before) / ops;
+}
+
+static void bench_size(BenchData *d, double seconds) {
+    static v2 group[MAX_BOARD_POINTS];
+
+    run("Board::get_group", d->size, seconds, [&]() {
+        long ops = 0;
+        for(int p = 0; p < POSITIONS; p++) {
+            Board *board = &d->positions[p].game.board;
+            for(int i = 0; i < d->size; i++) {
+                for(int j = 0; j < d->size; j++) {
+                    sink += board->get_group(i, j, group);
+                    ops++;
+                }
+            }
+        }
+        return ops;
+    });
+
+    run("Board::count_liberties", d->size, seconds, [&]() {
+        long ops = 0;
+        for(int p = 0; p < POSITIONS; p++) {
+            Board *board = &d->positions[p].game.board;
+            for(int g = d->group_begin[p]; g < d->group_begin[p+1]; g++, ops++)
+                sink += board->count_liberties(d->groups[g], d->group_sizes[g]);
+        }
+        return ops;
+    });
+
+    // the move is taken back right away, undo_move on its own is below
+    run("GameData::maybe_make_move+undo_move (quiet)", d->size, seconds, [&]() {
+        long ops = 0;
+        for(int p = 0; p < POSITIONS; p++) {
+            Position *pos = &d->positions[p];
+            for(int it = 0; it < pos->quiet_count; it++, ops++) {
+                sink += pos->game.maybe_make_move(pos->quiet[it].x, pos->quiet[it].y);
+                pos->game.undo_move();
+            }
+        }
+        return ops;
+    });
+
+    run("GameData::maybe_make_move+undo_move (capture)", d->size, seconds, [&]() {
+        long ops = 0;
+        for(int p = 0; p < POSITIONS; p++) {
+            Position *pos = &d->positions[p];
+            for(int it = 0; it < pos->capture_count; it++, ops++) {
+                sink += pos->game.maybe_make_move(pos->captures[it].x, pos->captures[it].y);
+                pos->game.undo_move();
+            }
+        }
+        return ops;
+    });
+
+    run("GameData::maybe_make_move (ko rejected)", d->size, seconds, [&]() {
+        for(int it = 0; it < 1000; it++)
+            sink += d->ko.maybe_make_move(d->ko_point.x, d->ko_point.y);
+        return 1000;
+    });
+
+    run("GameData::undo_move", d->size, seconds, [&]() {
+        int n = d->finished.log.move_count;
+        d->finished.undo_move(n);
+        sink += d->finished.board.hash;
+        // put the game back outside of the measurement
+        double start = now();
+        for(int it = 0; it < n; it++) d->finished.redo_move();
+        seconds_excluded += now() - start;
+        return (long)n;
+    });
+
+    run("GameData::redo_move", d->size, seconds, [&]() {
+        int n = d->finished.log.move_count;
+        double start = now();
+        d->finished.undo_move(n);
+        seconds_excluded += now() - start;
+        for(int it = 0; it < n; it++) d->finished.redo_move();
+        sink += d->finished.board.hash;
+        return (long)n;
+    });
+
+    run("GameData::winner", d->size, seconds, [&]() {
+        for(int it = 0; it < 100; it++)
+            sink += d->finished.winner();
+        return 100;
+    });
+}
+
+int main(int argc, char **argv) {
+    bool json = false;
+    bool check_allocations = false;
+    double seconds = 0.25;
+    for(int it = 1; it < argc; it++) {
+        if(strcmp(argv[it], "--json") == 0) json = true;
+        else if(strcmp(argv[it], "--check-allocations") == 0) check_allocations = true;
+        else seconds = atof(argv[it]);
+    }
+    // a single round of each is enough to see an allocation
+    if(check_allocations) seconds = 0;
+
+    int sizes[] = {9, 13, 19};
+    for(int size : sizes) {
+        BenchData *data = (BenchData *)calloc(1, sizeof(BenchData));
+        setup(data, size);
+        bench_size(data, seconds);
+        free(data);
+    }
+
+    if(check_allocations) {
+        int failed = 0;
+        for(int it = 0; it < result_count; it++) {
+            Result *r = &results[it];
+            if(r->allocations_per_op == 0) continue;
+            printf("%s on %dx%d allocates, %.3f allocations per call\n",
+                   r->name, r->size, r->size, r->allocations_per_op);
+            failed++;
+        }
+        if(failed) return 1;
+        printf("no allocations in %d benchmarks\n", result_count);
+        return 0;
+    }
+
+    if(json) {
+        printf("{\n  \"capture_engine\": %d,\n  \"positional_superko\": %d,\n  \"results\": [\n",
+               GO_CAPTURE_ENGINE, GO_POSITIONAL_SUPERKO);
+        for(int it = 0; it < result_count; it++) {
+            Result *r = &results[it];
+            printf("    {\"name\": \"%s\", \"board_size\": %d, \"ops\": %ld, "
+                   "\"ns_per_op\": %.2f, \"allocations_per_op\": %.3f}%s\n",
+                   r->name, r->size, r->ops, r->ns_per_op, r->allocations_per_op,
+                   it + 1 < result_count ? "," : "");
+        }
+        printf("  ]\n}\n");
+    } else {
+        printf("%-46s %5s %12s %10s %10s\n", "benchmark", "size", "ops", "ns/op", "allocs/op");
+        for(int it = 0; it < result_count; it++) {
+            Result *r = &results[it];
+            printf("%-46s %5d %12ld %10.1f %10.3f\n",
+                   r->name, r->size, r->ops, r->ns_per_op, r->allocations_per_op);
+        }
+    }
+    // keeps the results of the calls from being optimized out
+    return sink == 42;
+}
@@ -0,0 +1,169 @@
+// Playouts per second of the rules engine, for each board size and with
+// one independent playout loop per thread. Every size is run with
+// GameData and with the FixedGame<N> of that size.
+// --check plays the same seeds with both and fails if any game differs,
+// make runs it after building.
+//
+//   ./playout_bench [--check] [seconds per run] [max threads]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "game_logic.h"
+#include "playout.h"
+
+struct PlayoutThread {
+    pthread_t thread;
+    int board_size;
+    bool fixed;
+    double seconds;
+    uint64_t seed;
+
+    long playouts;
+    long moves;
+    long black_wins;
+};
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run_game_data(PlayoutThread *t) {
+    uint64_t rng = t->seed;
+    GameData start = {};
+    start.board.size = t->board_size;
+    GameData game;
+
+    double end = now() + t->seconds;
+    while(now() < end) {
+        // check the clock every few playouts only
+        for(int it = 0; it < 16; it++) {
+            game = start;
+            Stone winner = playout(&game, &rng);
+            t->playouts++;
+            t->moves += game.log.move_count;
+            if(winner == STONE_BLACK) t->black_wins++;
+        }
+    }
+}
+
+template <int N>
+static void run_fixed_game(PlayoutThread *t) {
+    uint64_t rng = t->seed;
+    FixedGame<N> game;
+
+    double end = now() + t->seconds;
+    while(now() < end) {
+        for(int it = 0; it < 16; it++) {
+            game = {};
+            Stone winner = playout(&game, &rng);
+            t->playouts++;
+            t->moves += game.move_count;
+            if(winner == STONE_BLACK) t->black_wins++;
+        }
+    }
+}
+
+static void *run_playouts(void *arg) {
+    PlayoutThread *t = (PlayoutThread *)arg;
+    if(!t->fixed) run_game_data(t);
+    else if(t->board_size == 9)  run_fixed_game<9>(t);
+    else if(t->board_size == 13) run_fixed_game<13>(t);
+    else                         run_fixed_game<19>(t);
+    return 0;
+}
+
+// plays the same seeds with GameData and FixedGame<N>, returns the number
+// of games that ended differently
+template <int N>
+static int check_fixed_game(int games) {
+    int mismatches = 0;
+    uint64_t rng = 0x9e3779b97f4a7c15;
+    for(int it = 0; it < games; it++) {
+        uint64_t fixed_rng = rng;
+        GameData game = {};
+        game.board.size = N;
+        float black = 0, white = 0;
+        Stone winner = playout(&game, &rng, &black, &white);
+
+        FixedGame<N> fixed = {};
+        float fixed_black = 0, fixed_white = 0;
+        Stone fixed_winner = playout(&fixed, &fixed_rng, &fixed_black, &fixed_white);
+
+        if(winner != fixed_winner || game.log.move_count != fixed.move_count ||
+           game.board.hash != fixed.board.hash || black != fixed_black || white != fixed_white ||
+           rng != fixed_rng) {
+            if(mismatches == 0)
+                printf("%dx%d game %d differs: %d moves, %.1f to %.1f with GameData, "
+                       "%d moves, %.1f to %.1f with FixedGame\n", N, N, it,
+                       game.log.move_count, black, white, fixed.move_count, fixed_black, fixed_white);
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+int main(int argc, char **argv) {
+    if(argc > 1 && strcmp(argv[1], "--check") == 0) {
+        int games = 200;
+        int mismatches = check_fixed_game<9>(games) + check_fixed_game<13>(games) +
+                         check_fixed_game<19>(games);
+        if(mismatches) {
+            printf("%d of %d FixedGame playouts differ from GameData\n", mismatches, 3 * games);
+            return 1;
+        }
+        printf("FixedGame playouts match GameData in %d games\n", 3 * games);
+        return 0;
+    }
+
+    double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+    int max_threads = argc > 2 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(max_threads < 1) max_threads = 1;
+
+    int sizes[] = {9, 13, 19};
+    printf("%5s %-9s %7s %12s %14s %12s %9s\n",
+           "size", "game", "threads", "playouts/s", "moves/playout", "us/playout", "black %");
+
+    for(int size : sizes) {
+        for(int fixed = 0; fixed < 2; fixed++) {
+            for(int threads = 1; threads <= max_threads; threads *= 2) {
+                PlayoutThread *ts = (PlayoutThread *)calloc(threads, sizeof(PlayoutThread));
+                for(int it = 0; it < threads; it++) {
+                    ts[it].board_size = size;
+                    ts[it].fixed = fixed;
+                    ts[it].seconds = seconds;
+                    ts[it].seed = 0x9e3779b97f4a7c15 * (it + 1);
+                }
+
+                double start = now();
+                for(int it = 0; it < threads; it++)
+                    pthread_create(&ts[it].thread, 0, run_playouts, &ts[it]);
+
+                long playouts = 0, moves = 0, black_wins = 0;
+                for(int it = 0; it < threads; it++) {
+                    pthread_join(ts[it].thread, 0);
+                    playouts += ts[it].playouts;
+                    moves += ts[it].moves;
+                    black_wins += ts[it].black_wins;
+                }
+                double elapsed = now() - start;
+
+                printf("%5d %-9s %7d %12.0f %14.1f %12.2f %9.1f\n", size,
+                       fixed ? "FixedGame" : "GameData", threads,
+                       playouts / elapsed, (double)moves / playouts,
+                       elapsed * threads * 1e6 / playouts,
+                       100.0 * black_wins / playouts);
+                free(ts);
+
+                // always measure the full machine as well
+                if(threads < max_threads && threads * 2 > max_threads)
+                    threads = max_threads / 2;
+            }
+        }
+    }
+}
@@ -0,0 +1,180 @@
+// Load generator for go_server: pairs of clients play random games against
+// each other on a running server and the number of moves per second the
+// server relays is reported. Every thread drives its pairs in turn, one
+// move at a time, and checks the move arrives at the opponent unchanged.
+//
+//   ./server_bench [threads] [pairs per thread] [seconds] [host]
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "game_logic.h"
+#include "protocol.h"
+#include "playout.h"
+
+#define SERVER_PORT 1234
+
+struct Pair {
+    // the player making the first move of a game, then the other one
+    int players[2];
+    GameData game;
+    uint64_t rng;
+};
+
+struct BenchThread {
+    pthread_t thread;
+    int index;
+    long moves;
+    long games;
+    double seconds;
+};
+
+static int thread_count = 4;
+static int pairs_per_thread = 50;
+static double seconds = 5.0;
+static const char *host = "127.0.0.1";
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fail(const char *what) {
+    fprintf(stderr, "server_bench: %s\n", what);
+    exit(1);
+}
+
+static int connect_to_server() {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(SERVER_PORT);
+    if(inet_pton(AF_INET, host, &address.sin_addr) != 1) fail("invalid host address");
+
+    int desc = socket(AF_INET, SOCK_STREAM, 0);
+    if(desc < 0 || connect(desc, (sockaddr *)&address, sizeof(address)))
+        fail("could not connect to the server");
+    int one = 1;
+    setsockopt(desc, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return desc;
+}
+
+static Response read_response(int desc, ResponseType expected) {
+    Response res = {};
+    if(read_struct(desc, &res)) fail("connection closed by the server");
+    if(res.type != expected) fail("unexpected response");
+    return res;
+}
+
+static void start_game(Pair *pair) {
+    Request req = {};
+    req.type = REQUEST_NEW_ROOM;
+    req.new_room.board_size = 9;
+    strcpy(req.new_room.name, "bench");
+    // with the thread model the previous room may not be freed yet
+    Response res = {};
+    for(int tries = 0; res.new_room_result.room_id == 0; tries++) {
+        if(tries == 1000) fail("could not create a room");
+        if(tries) usleep(100);
+        write_struct(pair->players[0], &req);
+        res = read_response(pair->players[0], RESPONSE_NEW_ROOM_RESULT);
+    }
+
+    req = {};
+    req.type = REQUEST_JOIN_ROOM;
+    req.join_room.room_id = res.new_room_result.room_id;
+    write_struct(pair->players[1], &req);
+    res = read_response(pair->players[1], RESPONSE_JOIN_RESULT);
+    if(!res.join_result.success) fail("could not join a room");
+    read_response(pair->players[0], RESPONSE_PLAYER_JOINED);
+
+    pair->game = {};
+    pair->game.board.size = 9;
+}
+
+static void *run_pairs(void *data) {
+    BenchThread *t = (BenchThread *)data;
+    Pair *pairs = (Pair *)calloc(pairs_per_thread, sizeof(Pair));
+    for(int it = 0; it < pairs_per_thread; it++) {
+        Pair *pair = &pairs[it];
+        pair->players[0] = connect_to_server();
+        pair->players[1] = connect_to_server();
+        pair->rng = 0x9e3779b97f4a7c15 * (t->index * pairs_per_thread + it + 1);
+        start_game(pair);
+    }
+
+    double start = now(), end = start + seconds;
+    while(now() < end) {
+        for(int it = 0; it < pairs_per_thread; it++) {
+            Pair *pair = &pairs[it];
+            int player = pair->game.active_player();
+            play_random_move(&pair->game, &pair->rng);
+            v2_8 move = pair->game.log.moves[pair->game.log.move_count-1];
+
+            Request req = {};
+            req.type = REQUEST_MAKE_MOVE;
+            req.make_move.move = move;
+            write_struct(pair->players[player], &req);
+            Response res = read_response(pair->players[!player], RESPONSE_NEW_MOVE);
+            if(res.new_move.move.x != move.x || res.new_move.move.y != move.y)
+                fail("the opponent got a different move");
+            t->moves++;
+
+            if(pair->game.winner()) {
+                // the server closed the room, both players are free again
+                t->games++;
+                start_game(pair);
+            }
+        }
+    }
+
+    t->seconds = now() - start;
+
+    Request req = {};
+    req.type = REQUEST_EXIT;
+    for(int it = 0; it < pairs_per_thread; it++) {
+        write_struct(pairs[it].players[0], &req);
+        write_struct(pairs[it].players[1], &req);
+        close(pairs[it].players[0]);
+        close(pairs[it].players[1]);
+    }
+    free(pairs);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if(argc > 1) thread_count = atoi(argv[1]);
+    if(argc > 2) pairs_per_thread = atoi(argv[2]);
+    if(argc > 3) seconds = atof(argv[3]);
+    if(argc > 4) host = argv[4];
+    if(thread_count < 1 || pairs_per_thread < 1) {
+        fprintf(stderr, "usage: %s [threads] [pairs per thread] [seconds] [host]\n", argv[0]);
+        return 1;
+    }
+
+    BenchThread *threads = (BenchThread *)calloc(thread_count, sizeof(BenchThread));
+    for(int it = 0; it < thread_count; it++) {
+        threads[it].index = it;
+        pthread_create(&threads[it].thread, 0, run_pairs, &threads[it]);
+    }
+    // connecting isn't measured, only the time the games were played
+    long moves = 0, games = 0;
+    double elapsed = 0;
+    for(int it = 0; it < thread_count; it++) {
+        pthread_join(threads[it].thread, 0);
+        moves += threads[it].moves;
+        games += threads[it].games;
+        if(threads[it].seconds > elapsed) elapsed = threads[it].seconds;
+    }
+
+    printf("%d connections: %ld moves in %.1f s, %.0f moves/s, %ld games finished\n",
+           thread_count * pairs_per_thread * 2, moves, elapsed, moves / elapsed, games);
+    free(threads);
+}
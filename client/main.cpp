@@ -21,6 +21,9 @@
 #include <unistd.h>
 #include <errno.h>
 
+#include <string>
+#include <vector>
+
 #define print_bytes(p) print_bytes_size(p, sizeof(*p))
 void print_bytes_size(void *p, size_t size) {
     for(uint32_t i = 0; i < size; i++) {
@@ -112,8 +115,33 @@ struct ClientState {
     std::vector<std::string> names;
     std::vector<bool> can_join;
     std::vector<Board> games;
+    // rooms matching the lobby's filters, only one page of them is fetched
+    int32_t rooms_total;
+    // a room was added or closed since the page was listed
+    bool lobby_stale;
+
+    // the room watched and its moves so far, replayed by the spectator
+    // window
+    int32_t spectated_room;
+    bool got_spectate_snapshot;
+    int32_t spectated_board_size;
+    v2_8 spectated_moves[512];
+    int32_t spectated_move_count;
+    bool spectated_game_over;
 };
 
+// as many rooms as the lobby window shows
+#define ROOMS_PER_PAGE 3
+
+// subscribing lists the page and keeps it up to date with lobby events
+void request_room_page(Connection *con, RequestListRooms query, bool subscribe) {
+    Request r = {};
+    r.type = subscribe ? REQUEST_SUBSCRIBE_LOBBY : REQUEST_LIST_ROOMS;
+    r.list_rooms = query;
+    r.list_rooms.limit = ROOMS_PER_PAGE;
+    send_request_async(con, r);
+}
+
 void *client_thread(void *t_data) {
     pthread_detach(pthread_self());
     ClientState *cs = (ClientState *)t_data;
@@ -130,6 +158,13 @@ void *client_thread(void *t_data) {
 
         switch(r.type) {
             case RESPONSE_NEW_MOVE: {
+                if(cs->spectated_room && r.new_move.room_id == cs->spectated_room) {
+                    // moves the snapshot had already may come again
+                    if(r.new_move.move_number == cs->spectated_move_count &&
+                       cs->spectated_move_count < 512)
+                        cs->spectated_moves[cs->spectated_move_count++] = r.new_move.move;
+                    break;
+                }
                 v2_8 m = r.new_move.move;
                 cs->opponent_move = {(int)m.x, (int)m.y};
                 cs->got_opponent_move = true;
@@ -148,6 +183,7 @@ void *client_thread(void *t_data) {
             } break;
             case RESPONSE_LIST_ROOMS: {
                 int size = r.list_rooms.size;
+                cs->rooms_total = r.list_rooms.total;
                 cs->names.clear();
                 cs->can_join.resize(size);
                 cs->games.resize(size);
@@ -166,8 +202,55 @@ void *client_thread(void *t_data) {
                     read_struct(cs->connection.desc, &cs->games[i]);
                     printf("room %d:\n\tname: %s\n\tcan_join: %d\n", i, name, (int)can_join);
                 }
+                cs->lobby_stale = false;
                 cs->got_game_list = true;
             } break;
+            case RESPONSE_LOBBY_EVENT: {
+                int32_t room_id = r.lobby_event.room_id;
+                char name[16];
+                Board board;
+                if(r.lobby_event.event == LOBBY_ROOM_ADDED)
+                    read_size(cs->connection.desc, name, 16);
+                if(r.lobby_event.event == LOBBY_ROOM_BOARD)
+                    read_struct(cs->connection.desc, &board);
+                // rooms on the page are updated in place, the page is
+                // listed again when rooms come or go
+                for(int i = 0; i < (int)cs->room_ids.size(); i++) {
+                    if(cs->room_ids[i] != room_id) continue;
+                    if(r.lobby_event.event == LOBBY_ROOM_FULL) cs->can_join[i] = false;
+                    if(r.lobby_event.event == LOBBY_ROOM_BOARD) cs->games[i] = board;
+                }
+                if(r.lobby_event.event == LOBBY_ROOM_ADDED || r.lobby_event.event == LOBBY_ROOM_CLOSED)
+                    cs->lobby_stale = true;
+            } break;
+            case RESPONSE_SPECTATE_SNAPSHOT: {
+                int count = r.spectate.move_count;
+                if(count < 0) {
+                    // the rest of the stream can't be told apart
+                    puts("server sent a snapshot with a negative move count");
+                    cs->connection_lost = true;
+                    pthread_exit(0);
+                }
+                // no game has more moves than the log holds, the rest of
+                // a longer snapshot is read and dropped
+                int kept = count < 512 ? count : 512;
+                read_size(cs->connection.desc, cs->spectated_moves, kept * sizeof(v2_8));
+                for(int i = kept; i < count; i++) {
+                    v2_8 dropped;
+                    read_struct(cs->connection.desc, &dropped);
+                }
+                count = kept;
+                if(r.spectate.room_id == 0) puts("the room can't be watched");
+                cs->spectated_room = r.spectate.room_id;
+                cs->spectated_board_size = r.spectate.board_size;
+                cs->spectated_move_count = count;
+                cs->spectated_game_over = false;
+                cs->got_spectate_snapshot = true;
+            } break;
+            case RESPONSE_SPECTATE_END: {
+                if(r.spectate.room_id == cs->spectated_room)
+                    cs->spectated_game_over = true;
+            } break;
             case RESPONSE_ILLEGAL_MOVE: {
                 read_struct(cs->connection.desc, &cs->game_data);
                 cs->update_game_data = true;
@@ -238,9 +321,11 @@ bool draw_board_interact(ImDrawList *dl, GameData *gd, ImVec2 p, float dim) {
     float field_sz = dim / (size + 1);
     ImGuiIO &io = ImGui::GetIO();
     ImVec2 mouse = io.MousePos;
+    // only hover points where the move would be accepted
+    Bitboard legal = gd->legal_moves();
     for(int i = 0; i < size; i++) {
         for(int j = 0; j < size; j++) {
-            if(gd->board.stone(i, j) != STONE_NONE) continue;
+            if(!legal[gd->board.index(i, j)]) continue;
             ImVec2 center = ImVec2(p.x + (i+1)*field_sz, p.y + (j+1)*field_sz);
             ImVec4 field = ImVec4(center.x - 0.5f * field_sz,
                                   center.y - 0.5f * field_sz,
@@ -435,9 +520,48 @@ int main(int, char**) {
             ImGui::End();
         }
 
+        // spectator window
+        static GameData watched = {};
+        if(cs.got_spectate_snapshot) {
+            cs.got_spectate_snapshot = false;
+            watched = {};
+            watched.board.size = cs.spectated_board_size;
+        }
+        if(cs.spectated_room) {
+            ImGui::Begin("Watching");
+            while(watched.log.move_count < cs.spectated_move_count) {
+                v2_8 m = cs.spectated_moves[watched.log.move_count];
+                if(!watched.maybe_make_move(m.x, m.y)) {
+                    puts("server sent an illegal move of the watched game");
+                    break;
+                }
+            }
+            ImGui::Text("room %d, %d moves%s", cs.spectated_room, (int)watched.log.move_count,
+                        cs.spectated_game_over ? ", the game is over" : "");
+            if(ImGui::Button("Stop watching")) {
+                Request r = {};
+                r.type = REQUEST_SPECTATE_ROOM;
+                send_request_async(&cs.connection, r);
+                cs.spectated_room = 0;
+            }
+            ImDrawList* draw_list = ImGui::GetWindowDrawList();
+            draw_board(draw_list, &watched.board, ImGui::GetCursorScreenPos(), 400.f);
+            ImGui::End();
+        }
+
         static bool show_game_list = false;
+        // filters and page of the lobby
+        static RequestListRooms lobby_query = {};
+        static bool live_lobby = false;
+        static uint32_t last_listed = 0;
+        if(live_lobby && cs.lobby_stale && SDL_GetTicks() - last_listed >= 1000) {
+            // at most once a second however busy the lobby is
+            cs.lobby_stale = false;
+            last_listed = SDL_GetTicks();
+            request_room_page(&cs.connection, lobby_query, true);
+        }
         if(show_game_list) {
-            ImGui::SetNextWindowSize(ImVec2(230, 650));
+            ImGui::SetNextWindowSize(ImVec2(230, 780));
             ImGui::Begin("Rooms list", &show_game_list, 0);
             ImDrawList* draw_list = ImGui::GetWindowDrawList();
             for(int i = 0; i < (int)cs.games.size(); i++) {
@@ -455,12 +579,36 @@ int main(int, char**) {
                         send_request_async(&cs.connection, r);
                         show_game_list = false;
                     }
+                } else if(!the_game_is_on) {
+                    ImGui::SameLine(170.f);
+                    char button_id[16] = {};
+                    sprintf(button_id, "Watch###%d", i);
+                    if(ImGui::Button(button_id)) {
+                        Request r = {};
+                        r.type = REQUEST_SPECTATE_ROOM;
+                        r.join_room.room_id = cs.room_ids[i];
+                        send_request_async(&cs.connection, r);
+                    }
                 }
                 ImVec2 p = ImGui::GetCursorScreenPos();
                 draw_board(draw_list, &cs.games[i], p, 200.f);
                 p.y += 230.f;
                 ImGui::SetCursorScreenPos(p);
             }
+            int32_t first = lobby_query.offset;
+            ImGui::Text("rooms %d-%d of %d", cs.games.size() ? first + 1 : 0,
+                        first + (int)cs.games.size(), cs.rooms_total);
+            if(first > 0 && ImGui::Button("Previous")) {
+                lobby_query.offset = first > ROOMS_PER_PAGE ? first - ROOMS_PER_PAGE : 0;
+                request_room_page(&cs.connection, lobby_query, live_lobby);
+            }
+            if(first + ROOMS_PER_PAGE < cs.rooms_total) {
+                if(first > 0) ImGui::SameLine();
+                if(ImGui::Button("Next")) {
+                    lobby_query.offset = first + ROOMS_PER_PAGE;
+                    request_room_page(&cs.connection, lobby_query, live_lobby);
+                }
+            }
             ImGui::End();
         }
 
@@ -480,11 +628,22 @@ int main(int, char**) {
                 }
             }
 
-            if(ImGui::Button("List rooms")) {
+            static int list_board_size = 0;
+            static bool list_joinable_only = false;
+            ImGui::InputInt("listed board size, 0 for any", &list_board_size);
+            ImGui::Checkbox("joinable rooms only", &list_joinable_only);
+            ImGui::InputText("room name starts with", lobby_query.name_prefix, 12);
+            if(ImGui::Checkbox("live updates", &live_lobby) && !live_lobby) {
                 Request r = {};
-                r.type = REQUEST_LIST_ROOMS;
+                r.type = REQUEST_UNSUBSCRIBE_LOBBY;
                 send_request_async(&cs.connection, r);
             }
+            if(ImGui::Button("List rooms")) {
+                lobby_query.offset = 0;
+                lobby_query.board_size = (int8_t)list_board_size;
+                lobby_query.flags = list_joinable_only ? LIST_ROOMS_JOINABLE_ONLY : 0;
+                request_room_page(&cs.connection, lobby_query, live_lobby);
+            }
             if(cs.got_game_list) {
                 cs.got_game_list = false;
                 show_game_list = true;
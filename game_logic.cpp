@@ -1,5 +1,6 @@
 #include "game_logic.h"
 #include <cassert>
+#include <algorithm>
 
 inline Stone other_stone_color(Stone s) {
     assert(s & 0b01);
@@ -10,12 +11,220 @@ inline Stone bool_to_stone(bool b) {
     return (Stone)((b << 1) | 0b1);
 }
 
+struct ZobristTable {
+    // [0] for black stones, [1] for white ones
+    uint64_t keys[2][BOARD_CELLS];
+};
+
+static constexpr ZobristTable make_zobrist_table() {
+    ZobristTable table = {};
+    // splitmix64 with a fixed seed, hashes have to match between builds
+    uint64_t state = 0x676f5f7365727665;
+    for(int c = 0; c < 2; c++) {
+        for(int k = 0; k < BOARD_CELLS; k++) {
+            uint64_t z = (state += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            table.keys[c][k] = z ^ (z >> 31);
+        }
+    }
+    return table;
+}
+
+static constexpr ZobristTable zobrist = make_zobrist_table();
+
+struct BoardGeometry {
+    // index offsets of the four neighbours, in the order of neighbour_deltas
+    int32_t neighbour_offsets[4];
+    Bitboard on_board;
+};
+
+static constexpr v2 neighbour_deltas[4] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+
+struct BoardGeometryTable {
+    BoardGeometry sizes[MAX_BOARD_SIZE+1];
+};
+
+static constexpr BoardGeometryTable make_geometry_table() {
+    BoardGeometryTable table = {};
+    for(int size = 1; size <= MAX_BOARD_SIZE; size++) {
+        BoardGeometry *g = &table.sizes[size];
+        int stride = BOARD_STRIDE(size);
+        for(int d = 0; d < 4; d++)
+            g->neighbour_offsets[d] = neighbour_deltas[d].x*stride + neighbour_deltas[d].y;
+        for(int i = 0; i < size; i++) {
+            for(int j = 0; j < size; j++) {
+                int k = (i+1)*stride + j+1;
+                g->on_board.words[k >> 6] |= (uint64_t)1 << (k & 63);
+            }
+        }
+    }
+    return table;
+}
+
+static constexpr BoardGeometryTable geometry = make_geometry_table();
+
+template <int W, int V>
+static BitboardN<W> resize(BitboardN<V> b) {
+    BitboardN<W> result = {};
+    for(int w = 0; w < W && w < V; w++)
+        result.words[w] = b.words[w];
+    return result;
+}
+
+// Bit-parallel rules for boards of size N. N == 0 stands for any size, it
+// uses the widest bitboards and a stride only known at runtime, the common
+// sizes get constant strides and only as many words as they need.
+template <int N>
+struct Kernel {
+    static constexpr int W = N ? BITBOARD_WORDS_FOR(N) : BITBOARD_WORDS;
+    typedef BitboardN<W> Bits;
+
+    int stride;
+    Bits on_board;
+
+    Kernel(int size) {
+        assert(N == 0 || N == size);
+        stride = BOARD_STRIDE(N ? N : size);
+        on_board = resize<W>(geometry.sizes[N ? N : size].on_board);
+    }
+
+    Bits neighbours(Bits b) {
+        // the sentinel column keeps rows from wrapping into each other
+        Bits result = (b << 1) | (b >> 1) | (b << stride) | (b >> stride);
+        return result & on_board;
+    }
+
+    // grows seed through orthogonally adjacent points of mask
+    Bits flood(Bits seed, Bits mask) {
+        Bits result = seed & mask;
+        while(true) {
+            Bits next = (result | neighbours(result)) & mask;
+            if(next == result) break;
+            result = next;
+        }
+        return result;
+    }
+
+    // places a stone on the empty point k and takes off the enemy chains
+    // left without liberties, returning them in captured. Suicide returns
+    // false and leaves the bitboards unchanged.
+    bool place(Bits *stones, Bits *colors, int k, bool white, Bits *captured) {
+        Bits point = {};
+        point.set(k);
+        Bits white_stones = *stones & *colors;
+        Bits black_stones = *stones & ~*colors;
+        Bits own   = (white ? white_stones : black_stones) | point;
+        Bits enemy = white ? black_stones : white_stones;
+        Bits empty = on_board & ~(*stones | point);
+
+        *captured = {};
+        Bits adjacent = neighbours(point) & enemy;
+        while(adjacent.any()) {
+            Bits seed = {};
+            seed.set(adjacent.first());
+            Bits g = flood(seed, enemy);
+            adjacent &= ~g;
+            if(!(neighbours(g) & empty).any())
+                *captured |= g;
+        }
+
+        if(!captured->any()) {
+            Bits g = flood(point, own);
+            if(!(neighbours(g) & empty).any())
+                return false;
+        }
+
+        *stones = (*stones | point) & ~*captured;
+        if(white) *colors |= point;
+        *colors = *colors & ~*captured;
+        return true;
+    }
+
+    // Empty points where a stone of the given color would not be suicide:
+    // those with an empty neighbour, next to a friendly chain with another
+    // liberty, or taking the last liberty of an enemy chain. Enemy chains
+    // in atari are returned in enemy_atari. Ko is left to the caller.
+    Bits legal(Bits stones, Bits colors, bool white, Bits *enemy_atari) {
+        Bits empty = on_board & ~stones;
+        Bits own = stones & (white ? colors : ~colors);
+        Bits own_safe = {};
+        *enemy_atari = {};
+
+        Bits todo = stones;
+        while(todo.any()) {
+            Bits seed = {};
+            seed.set(todo.first());
+            bool friendly = (own & seed).any();
+            Bits g = flood(seed, friendly ? own : stones & ~own);
+            todo &= ~g;
+
+            Bits liberties = neighbours(g) & empty;
+            bool in_atari = liberties.count() == 1;
+            if(friendly && !in_atari) own_safe |= g;
+            if(!friendly && in_atari) *enemy_atari |= g;
+        }
+
+        Bits result = neighbours(empty) | neighbours(own_safe) | neighbours(*enemy_atari);
+        return result & empty;
+    }
+
+    // Counts the empty points only reachable from stones of one color. All
+    // regions are flooded at once, starting from the empty points next to
+    // each color and growing through empty points.
+    void territory(Bits stones, Bits colors, int *black, int *white) {
+        Bits empty = on_board & ~stones;
+        Bits black_reach = flood(neighbours(stones & ~colors), empty);
+        Bits white_reach = flood(neighbours(stones & colors), empty);
+        *black = (black_reach & ~white_reach).count();
+        *white = (white_reach & ~black_reach).count();
+    }
+};
+
+template <int W>
+static uint64_t captured_hash(BitboardN<W> captured, bool white) {
+    uint64_t hash = 0;
+    for(int k = captured.first(); k != -1; k = captured.first()) {
+        captured.reset(k);
+        hash ^= zobrist.keys[white][k];
+    }
+    return hash;
+}
+
+template <int N>
+static void count_territory(Board *board, int *black, int *white) {
+    Kernel<N>(board->size).territory(resize<Kernel<N>::W>(board->stones),
+                                     resize<Kernel<N>::W>(board->colors),
+                                     black, white);
+}
+
+static float komi(int size) {
+    if(size > 12) return 6.5f;
+    return 3.5f;
+}
+
+template <int N>
+static bool place_stone(Board *board, int k, bool white, Bitboard *captured) {
+    typedef typename Kernel<N>::Bits Bits;
+    Bits stones = resize<Kernel<N>::W>(board->stones);
+    Bits colors = resize<Kernel<N>::W>(board->colors);
+    Bits removed;
+    if(!Kernel<N>(board->size).place(&stones, &colors, k, white, &removed))
+        return false;
+
+    board->stones = resize<BITBOARD_WORDS>(stones);
+    board->colors = resize<BITBOARD_WORDS>(colors);
+    board->hash ^= zobrist.keys[white][k] ^ captured_hash(removed, !white);
+    *captured = resize<BITBOARD_WORDS>(removed);
+    return true;
+}
+
 Stone Board::stone(int i, int j) {
     assert(i >= 0 && i < size);
     assert(j >= 0 && j < size);
 
-    uint32_t stone_bit = stones[i*size + j] != 0;
-    uint32_t color_bit = colors[i*size + j] != 0;
+    uint32_t stone_bit = stones[index(i, j)] != 0;
+    uint32_t color_bit = colors[index(i, j)] != 0;
     uint32_t result = stone_bit | (color_bit << 1);
     return (Stone)result;
 }
@@ -24,97 +233,298 @@ void Board::set(int i, int j, Stone s) {
     assert(i >= 0 && i < size);
     assert(j >= 0 && j < size);
 
+    int k = index(i, j);
+    if(stones[k])
+        hash ^= zobrist.keys[colors[k]][k];
+    if(s != STONE_NONE)
+        hash ^= zobrist.keys[s == STONE_WHITE][k];
+
+#if GO_CAPTURE_ENGINE == GO_ENGINE_CHAINS
+    if(stones[k]) {
+        stones.reset(k);
+        colors.reset(k);
+        chain_remove_stone(k);
+    }
+    if(s == STONE_NONE) return;
+    stones.set(k);
+    if(s == STONE_WHITE)
+        colors.set(k);
+    chain_add_stone(k);
+#else
     if(s == STONE_NONE) {
-        stones.reset(i*size + j);
-        colors.reset(i*size + j);
+        stones.reset(k);
+        colors.reset(k);
         return;
     }
-    stones.set(i*size + j);
+    stones.set(k);
     if(s == STONE_WHITE)
-        colors.set(i*size + j);
+        colors.set(k);
+#endif
 }
 
-std::vector<v2> Board::get_group(int x, int y) {
-    std::vector<v2> group;
-    std::queue<v2> queue;
+Bitboard Board::on_board() {
+    assert(size > 0 && size <= MAX_BOARD_SIZE);
+    return geometry.sizes[size].on_board;
+}
 
-    if(x < 0 || x >= size || y < 0 || y >= size)
-        return group;
+Bitboard Board::stones_of(Stone s) {
+    if(s == STONE_NONE)  return on_board() & ~stones;
+    if(s == STONE_WHITE) return stones & colors;
+    return stones & ~colors;
+}
 
-    bool visited[MAX_BOARD_SIZE][MAX_BOARD_SIZE] = {};
+Bitboard Board::neighbours(Bitboard b) {
+    return Kernel<0>(size).neighbours(b);
+}
+
+Bitboard Board::flood(Bitboard seed, Bitboard mask) {
+    return Kernel<0>(size).flood(seed, mask);
+}
+
+int Board::get_group(int x, int y, v2 *group) {
+    if(x < 0 || x >= size || y < 0 || y >= size)
+        return 0;
 
     auto group_type = stone(x,y);
     if(group_type == STONE_NONE)
-        return group;
-
-    queue.push({x,y});
-    while(!queue.empty()) {
-        auto el = queue.front();
-        queue.pop();
-
-        auto s = stone(el.x, el.y);
-        if(s != group_type) continue;
-
-        group.push_back(el);
-
-        int dx[] = {1, 0, -1, 0};
-        int dy[] = {0, 1, 0, -1};
-        for(int i = 0; i < 4; i++) {
-            int nx = el.x + dx[i];
-            int ny = el.y + dy[i];
-            if(nx < 0 || nx >= size || ny < 0 || ny >= size) continue;
-            if(!visited[nx][ny]) {
-                visited[nx][ny] = true;
-                queue.push({nx, ny});
+        return 0;
+
+    const int32_t *offsets = geometry.sizes[size].neighbour_offsets;
+    // sentinel points are never stones, so they never join the group
+    Bitboard unvisited = stones_of(group_type);
+
+    // the group itself is the queue, stones before head have been expanded
+    int head = 0;
+    int group_size = 0;
+    group[group_size++] = {x,y};
+    unvisited.reset(index(x, y));
+    while(head < group_size) {
+        auto el = group[head++];
+        int k = index(el.x, el.y);
+
+        for(int d = 0; d < 4; d++) {
+            int n = k + offsets[d];
+            if(unvisited[n]) {
+                unvisited.reset(n);
+                group[group_size++] = {el.x + neighbour_deltas[d].x,
+                                       el.y + neighbour_deltas[d].y};
             }
         }
     }
 
-    return group;
+    return group_size;
 }
 
-int Board::count_liberties(std::vector<v2> group) {
-    assert(group.size() > 0);
-    int result = 0;
-    bool visited[MAX_BOARD_SIZE][MAX_BOARD_SIZE] = {};
+int Board::count_liberties(v2 *group, int group_size) {
+    assert(group_size > 0);
+    const int32_t *offsets = geometry.sizes[size].neighbour_offsets;
+    Bitboard empty = stones_of(STONE_NONE);
+    Bitboard liberties = {};
+
+    for(int it = 0; it < group_size; it++) {
+        int k = index(group[it].x, group[it].y);
+        for(int d = 0; d < 4; d++) {
+            int n = k + offsets[d];
+            liberties.words[n >> 6] |= (uint64_t)empty[n] << (n & 63);
+        }
+    }
+
+    return liberties.count();
+}
+
+#if GO_CAPTURE_ENGINE == GO_ENGINE_CHAINS
+// writes the neighbours of k that are on the board, returns their count
+static int neighbour_points(int k, int size, int out[4]) {
+    const BoardGeometry *g = &geometry.sizes[size];
+    int count = 0;
+    for(int d = 0; d < 4; d++) {
+        out[count] = k + g->neighbour_offsets[d];
+        count += g->on_board[out[count]];
+    }
+    return count;
+}
+
+static void add_liberty(Chain *c, int k) {
+    c->liberties++;
+    c->liberty_sum += k;
+    c->liberty_sum_sq += k*k;
+}
 
-    v2 delta[] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+static void remove_liberty(Chain *c, int k) {
+    c->liberties--;
+    c->liberty_sum -= k;
+    c->liberty_sum_sq -= k*k;
+}
+
+int Board::atari_point(int head) {
+    Chain *c = &chains.chains[head];
+    if(c->liberties == 0) return -1;
+    int64_t sum = c->liberty_sum;
+    if(sum*sum != (int64_t)c->liberties * c->liberty_sum_sq) return -1;
+    return (int)(sum / c->liberties);
+}
+
+bool Board::in_atari(int i, int j) {
+    int head = chain_head(index(i, j));
+    if(head == -1) return false;
+    return atari_point(head) != -1;
+}
 
-    for(auto it : group) {
-        for(int i = 0; i < 4; i++) {
-            int x = it.x + delta[i].x;
-            int y = it.y + delta[i].y;
-            if(x >= 0 && x < size && y >= 0 && y < size) {
-                if(visited[x][y]) continue;
+// called after the stone bits at k have been set
+void Board::chain_add_stone(int k) {
+    chains.head[k] = k+1;
+    chains.next[k] = k;
+    Chain *chain = &chains.chains[k];
+    *chain = {};
+    chain->stone_count = 1;
+
+    int n[4];
+    int count = neighbour_points(k, size, n);
+    for(int it = 0; it < count; it++) {
+        if(!stones[n[it]])
+            add_liberty(chain, n[it]);
+        else
+            remove_liberty(&chains.chains[chain_head(n[it])], k);
+    }
+
+    // merge with friendly neighbours, relabeling the smaller chain
+    for(int it = 0; it < count; it++) {
+        if(!stones[n[it]] || colors[n[it]] != colors[k]) continue;
+        int a = chain_head(k);
+        int b = chain_head(n[it]);
+        if(a == b) continue;
+        if(chains.chains[a].stone_count < chains.chains[b].stone_count) {
+            int t = a; a = b; b = t;
+        }
 
-                result += (stone(x, y) == STONE_NONE);
-                visited[x][y] = true;
+        int q = b;
+        do {
+            chains.head[q] = a+1;
+            q = chains.next[q];
+        } while(q != b);
+
+        int16_t t = chains.next[a];
+        chains.next[a] = chains.next[b];
+        chains.next[b] = t;
+
+        Chain *ca = &chains.chains[a];
+        Chain *cb = &chains.chains[b];
+        ca->stone_count    += cb->stone_count;
+        ca->liberties      += cb->liberties;
+        ca->liberty_sum    += cb->liberty_sum;
+        ca->liberty_sum_sq += cb->liberty_sum_sq;
+    }
+}
+
+// called after the stone bits at k have been cleared, the rest of the
+// chain may fall apart into several chains which are rebuilt from scratch
+void Board::chain_remove_stone(int k) {
+    int head = chain_head(k);
+    assert(head != -1);
+
+    int16_t members[BOARD_CELLS];
+    int member_count = 0;
+    for(int q = chains.next[k]; q != k; q = chains.next[q]) {
+        members[member_count++] = q;
+        chains.head[q] = 0;
+    }
+    chains.head[k] = 0;
+
+    int n[4];
+    int count = neighbour_points(k, size, n);
+    for(int it = 0; it < count; it++) {
+        int h = chain_head(n[it]);
+        if(h != -1) add_liberty(&chains.chains[h], k);
+    }
+
+    for(int it = 0; it < member_count; it++) {
+        if(chains.head[members[it]] == 0)
+            chain_rebuild(members[it]);
+    }
+}
+
+// flood fills a new chain from k over same colored stones without a chain
+void Board::chain_rebuild(int k) {
+    int16_t stack[BOARD_CELLS];
+    int top = 0;
+
+    chains.head[k] = k+1;
+    chains.next[k] = k;
+    Chain *chain = &chains.chains[k];
+    *chain = {};
+    stack[top++] = k;
+
+    while(top > 0) {
+        int q = stack[--top];
+        chain->stone_count++;
+
+        int n[4];
+        int count = neighbour_points(q, size, n);
+        for(int it = 0; it < count; it++) {
+            int p = n[it];
+            if(!stones[p]) {
+                add_liberty(chain, p);
+            } else if(colors[p] == colors[k] && chains.head[p] == 0) {
+                chains.head[p] = k+1;
+                chains.next[p] = chains.next[k];
+                chains.next[k] = p;
+                stack[top++] = p;
             }
         }
     }
+}
 
-    return result;
+void Board::remove_chain(int head, Bitboard *removed) {
+    int q = head;
+    do {
+        hash ^= zobrist.keys[colors[q]][q];
+        stones.reset(q);
+        colors.reset(q);
+        chains.head[q] = 0;
+        removed->set(q);
+        q = chains.next[q];
+    } while(q != head);
+
+    q = head;
+    do {
+        int n[4];
+        int count = neighbour_points(q, size, n);
+        for(int it = 0; it < count; it++) {
+            int h = chain_head(n[it]);
+            if(h != -1) add_liberty(&chains.chains[h], q);
+        }
+        q = chains.next[q];
+    } while(q != head);
 }
+#endif
 
-void MoveLog::register_move(int i, int j) {
+void MoveLog::register_move(int i, int j, uint64_t hash) {
     assert(i >= -2 && i < MAX_BOARD_SIZE);
     assert(j >= 0 && j < MAX_BOARD_SIZE);
     assert(move_count < 512);
 
     v2_8 v = {(int8_t)i, (int8_t)j};
+    hashes[move_count] = hash;
     moves[move_count++] = v;
     if(last_valid_move_count < move_count)
         last_valid_move_count = move_count;
 }
 
-void MoveLog::register_remove(std::vector<v2> stones) {
-    removed_count[move_count-1] = stones.size();
-    for(auto it : stones) {
-        removed[removed_count_total++] = {(int8_t)it.x, (int8_t)it.y};
+void MoveLog::register_remove(v2 *stones, int count) {
+    removed_count[move_count-1] = count;
+    for(int it = 0; it < count; it++) {
+        removed[removed_count_total++] = {(int8_t)stones[it].x, (int8_t)stones[it].y};
     }
 }
 
-inline bool GameData::active_player() {
+uint64_t MoveLog::position_hash(int n) {
+    assert(n >= 0 && n <= move_count);
+    // the game starts from an empty board which hashes to zero
+    if(n == 0) return 0;
+    return hashes[n-1];
+}
+
+bool GameData::active_player() {
     return (bool)(log.move_count & 0x1);
 }
 
@@ -125,7 +535,7 @@ bool GameData::maybe_make_move(int i, int j) {
 
     if(i == -1 || i == -2) {
         // pass or resign
-        log.register_move(i, j);
+        log.register_move(i, j, board.hash);
         return true;
     } else if(i < 0 || i >= board.size || j < 0 || j >= board.size) {
         return false;
@@ -134,62 +544,259 @@ bool GameData::maybe_make_move(int i, int j) {
     if(board.stone(i, j) != STONE_NONE)
         return false;
 
-    GameData previous_state = *this;
-    previous_state.undo_move();
+    v2 stones_to_remove[MAX_BOARD_POINTS];
+    int remove_count = 0;
+
+#if GO_CAPTURE_ENGINE == GO_ENGINE_CHAINS
+    Bitboard captured = {};
+    int k = board.index(i, j);
+    int n[4];
+    int count = neighbour_points(k, board.size, n);
+
+    // the move is suicide unless it has an empty neighbour, connects
+    // to a chain with another liberty or takes the last liberty of an
+    // enemy chain
+    bool has_liberty = false;
+    for(int it = 0; it < count; it++) {
+        if(!board.stones[n[it]]) { has_liberty = true; break; }
+        bool friendly = board.colors[n[it]] == (s == STONE_WHITE);
+        bool last_liberty = board.atari_point(board.chain_head(n[it])) == k;
+        if(friendly != last_liberty) { has_liberty = true; break; }
+    }
+    if(!has_liberty) return false;
 
     board.set(i, j, s);
+    for(int it = 0; it < count; it++) {
+        int h = board.chain_head(n[it]);
+        if(h == -1 || board.colors[n[it]] == (s == STONE_WHITE)) continue;
+        if(board.chains.chains[h].liberties == 0)
+            board.remove_chain(h, &captured);
+    }
+
+    for(int k = captured.first(); k != -1; k = captured.first()) {
+        captured.reset(k);
+        stones_to_remove[remove_count++] = board.point(k);
+    }
+#elif GO_CAPTURE_ENGINE == GO_ENGINE_BITBOARD
+    // the common sizes run the kernel specialized for them
+    Bitboard captured = {};
+    int k = board.index(i, j);
+    bool white = (s == STONE_WHITE);
+    bool placed;
+    switch(board.size) {
+        case 9:  placed = place_stone<9>(&board, k, white, &captured); break;
+        case 13: placed = place_stone<13>(&board, k, white, &captured); break;
+        case 19: placed = place_stone<19>(&board, k, white, &captured); break;
+        default: placed = place_stone<0>(&board, k, white, &captured); break;
+    }
+    if(!placed) return false;
 
-    bool visited[MAX_BOARD_SIZE][MAX_BOARD_SIZE] = {};
-    std::vector<v2> stones_to_remove;
+    for(int k = captured.first(); k != -1; k = captured.first()) {
+        captured.reset(k);
+        stones_to_remove[remove_count++] = board.point(k);
+    }
+#else
+    board.set(i, j, s);
 
-    v2 delta[] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
-    for(int it = 0; it < 4; it++) {
-        int x = i + delta[it].x;
-        int y = j + delta[it].y;
-        if(x < 0 || x >= board.size ||
-           y < 0 || y >= board.size)
-            continue;
+    const int32_t *offsets = geometry.sizes[board.size].neighbour_offsets;
+    int k = board.index(i, j);
+    // off-board points are never enemy stones
+    Bitboard enemy = board.stones_of(other_stone_color(s));
+    Bitboard removed = {};
 
-        if(board.stone(x, y) == s ||
-           board.stone(x, y) == STONE_NONE)
+    for(int d = 0; d < 4; d++) {
+        int n = k + offsets[d];
+        if(!enemy[n] || removed[n])
             continue;
 
-        auto g = board.get_group(x, y);
-        int libs = board.count_liberties(g);
+        v2 g[MAX_BOARD_POINTS];
+        int group_size = board.get_group(i + neighbour_deltas[d].x,
+                                         j + neighbour_deltas[d].y, g);
+        int libs = board.count_liberties(g, group_size);
         if(libs == 0) {
-            for(v2 it : g) {
-                if(!visited[it.x][it.y]) {
-                    stones_to_remove.push_back(it);
-                    visited[it.x][it.y] = true;
-                }
+            for(int it = 0; it < group_size; it++) {
+                removed.set(board.index(g[it].x, g[it].y));
+                stones_to_remove[remove_count++] = g[it];
             }
         }
     }
 
-    auto current_move_group = board.get_group(i, j);
-    int libs = board.count_liberties(current_move_group);
-    if(libs == 0 && stones_to_remove.size() == 0) {
+    v2 current_move_group[MAX_BOARD_POINTS];
+    int group_size = board.get_group(i, j, current_move_group);
+    int libs = board.count_liberties(current_move_group, group_size);
+    if(libs == 0 && remove_count == 0) {
         board.set(i, j, STONE_NONE);
         return false;
     }
 
-    for(v2 it : stones_to_remove)
-        board.set(it.x, it.y, STONE_NONE);
+    // the move log lists removed stones in board order, the same order
+    // the bitboard engine produces them in
+    std::sort(stones_to_remove, stones_to_remove + remove_count, [](v2 a, v2 b) {
+        return a.x < b.x || (a.x == b.x && a.y < b.y);
+    });
+#endif
+
+#if GO_CAPTURE_ENGINE == GO_ENGINE_BFS
+    for(int k = 0; k < remove_count; k++)
+        board.set(stones_to_remove[k].x, stones_to_remove[k].y, STONE_NONE);
+#endif
     
     // verify against ko rule
-    if(previous_state.board.stones == board.stones) {
+    if(repeats_position(board.hash)) {
         board.set(i, j, STONE_NONE);
-        for(v2 it : stones_to_remove)
-            board.set(it.x, it.y, other_stone_color(s));
+        for(int k = 0; k < remove_count; k++)
+            board.set(stones_to_remove[k].x, stones_to_remove[k].y, other_stone_color(s));
         return false;
     }
 
     // move successful
-    log.register_move(i, j);
-    log.register_remove(stones_to_remove);
+    log.register_move(i, j, board.hash);
+    log.register_remove(stones_to_remove, remove_count);
+    return true;
+}
+
+template <int N>
+BitboardN<FixedBoard<N>::words> FixedBoard<N>::on_board() {
+    return resize<words>(geometry.sizes[N].on_board);
+}
+
+template <int N>
+bool FixedGame<N>::maybe_make_move(int i, int j) {
+    if(i == -1) return pass();
+    if(i < 0 || i >= N || j < 0 || j >= N) return false;
+
+    int k = board.index(i, j);
+    if(board.stones[k]) return false;
+
+    bool white = active_player();
+    auto stones = board.stones;
+    auto colors = board.colors;
+    BitboardN<FixedBoard<N>::words> captured;
+    if(!Kernel<N>(N).place(&stones, &colors, k, white, &captured))
+        return false;
+
+    uint64_t hash = board.hash ^ zobrist.keys[white][k] ^ captured_hash(captured, !white);
+    if(move_count > 0 && hash == previous_hash)
+        return false;
+
+    previous_hash = board.hash;
+    board.stones = stones;
+    board.colors = colors;
+    board.hash = hash;
+    captures[white] += captured.count();
+    move_count++;
+    consecutive_passes = 0;
     return true;
 }
 
+template <int N>
+bool FixedGame<N>::pass() {
+    previous_hash = board.hash;
+    move_count++;
+    consecutive_passes++;
+    return true;
+}
+
+template <int N>
+BitboardN<FixedBoard<N>::words> FixedGame<N>::legal_moves() {
+    typedef BitboardN<FixedBoard<N>::words> Bits;
+    Kernel<N> kernel(N);
+    bool white = active_player();
+    Bits enemy_atari;
+    Bits legal = kernel.legal(board.stones, board.colors, white, &enemy_atari);
+
+    if(move_count == 0) return legal;
+    Bits candidates = legal & kernel.neighbours(enemy_atari);
+    for(int k = candidates.first(); k != -1; k = candidates.first()) {
+        candidates.reset(k);
+        Bits point = {};
+        point.set(k);
+        Bits taken = kernel.flood(kernel.neighbours(point) & enemy_atari, enemy_atari);
+        uint64_t hash = board.hash ^ zobrist.keys[white][k] ^ captured_hash(taken, !white);
+        if(hash == previous_hash)
+            legal.reset(k);
+    }
+    return legal;
+}
+
+template <int N>
+Stone FixedGame<N>::winner(float *black_points, float *white_points) {
+    if(consecutive_passes < 2) return STONE_NONE;
+
+    float white_score = 0;
+    float black_score = 0;
+    if(!white_points) white_points = &white_score;
+    if(!black_points) black_points = &black_score;
+
+    int black_territory, white_territory;
+    Kernel<N>(N).territory(board.stones, board.colors, &black_territory, &white_territory);
+    *black_points += black_territory + captures[0];
+    *white_points += white_territory + captures[1] + komi(N);
+
+    if(*white_points > *black_points) return STONE_WHITE;
+    else return STONE_BLACK;
+}
+
+template struct FixedBoard<9>;
+template struct FixedBoard<13>;
+template struct FixedBoard<19>;
+template struct FixedGame<9>;
+template struct FixedGame<13>;
+template struct FixedGame<19>;
+
+bool GameData::repeats_position(uint64_t hash) {
+    bool result = false;
+#if GO_POSITIONAL_SUPERKO
+    for(int n = 0; n < log.move_count; n++)
+        result |= (log.position_hash(n) == hash);
+#else
+    // same position as before the opponent's last move
+    if(log.move_count > 0)
+        result = (log.position_hash(log.move_count-1) == hash);
+#endif
+    return result;
+}
+
+template <int N>
+static Bitboard legal_moves_for(GameData *game) {
+    typedef typename Kernel<N>::Bits Bits;
+    Kernel<N> kernel(game->board.size);
+    Board *board = &game->board;
+    bool white = game->active_player();
+
+    Bits enemy_atari;
+    Bits stones = resize<Kernel<N>::W>(board->stones);
+    Bits colors = resize<Kernel<N>::W>(board->colors);
+    Bits legal = kernel.legal(stones, colors, white, &enemy_atari);
+
+    // only captures can repeat the position before the opponent's last
+    // move, with superko every move has to be checked against the history
+    Bits candidates = legal & kernel.neighbours(enemy_atari);
+#if GO_POSITIONAL_SUPERKO
+    candidates = legal;
+#endif
+    for(int k = candidates.first(); k != -1; k = candidates.first()) {
+        candidates.reset(k);
+        Bits point = {};
+        point.set(k);
+        Bits taken = kernel.flood(kernel.neighbours(point) & enemy_atari, enemy_atari);
+        uint64_t hash = board->hash ^ zobrist.keys[white][k] ^ captured_hash(taken, !white);
+        if(game->repeats_position(hash))
+            legal.reset(k);
+    }
+
+    return resize<BITBOARD_WORDS>(legal);
+}
+
+Bitboard GameData::legal_moves() {
+    switch(board.size) {
+        case 9:  return legal_moves_for<9>(this);
+        case 13: return legal_moves_for<13>(this);
+        case 19: return legal_moves_for<19>(this);
+        default: return legal_moves_for<0>(this);
+    }
+}
+
 bool GameData::pass() {
     return maybe_make_move(-1, 0);
 }
@@ -208,38 +815,44 @@ void Board::count_region(int i, int j, bool visited[19][19],
     Stone wall_type = STONE_NONE;
     int region_size = 0;
     bool assign_points = true;
-    std::queue<v2> queue;
-    queue.push({i,j});
-    visited[i][j] = true;
-
-    while(!queue.empty()) {
-        auto el = queue.front();
-        queue.pop();
 
-        auto s = stone(el.x, el.y);
-        if(s != STONE_NONE) {
-            if(wall_type == STONE_NONE)
-                wall_type = s;
-            else if(s != wall_type)
-                assign_points = false;
-            continue;
-        }
+    visited[i][j] = true;
+    if(stone(i, j) != STONE_NONE) return;
+
+    const int32_t *offsets = geometry.sizes[size].neighbour_offsets;
+    Bitboard unvisited = stones_of(STONE_NONE);
+    // points of each color touching the region
+    Bitboard walls = {};
+
+    // every point is queued at most once
+    v2 queue[MAX_BOARD_POINTS];
+    int head = 0, tail = 0;
+    queue[tail++] = {i,j};
+    unvisited.reset(index(i, j));
+
+    while(head < tail) {
+        auto el = queue[head++];
+        int k = index(el.x, el.y);
         region_size++;
 
-        int dx[] = {1, 0, -1, 0};
-        int dy[] = {0, 1, 0, -1};
-        for(int i = 0; i < 4; i++) {
-            int nx = el.x + dx[i];
-            int ny = el.y + dy[i];
-            if(nx < 0 || nx >= size || ny < 0 || ny >= size)
-                continue;
-            if(!visited[nx][ny]) {
-                visited[nx][ny] = true;
-                queue.push({nx, ny});
+        for(int d = 0; d < 4; d++) {
+            int n = k + offsets[d];
+            walls.words[n >> 6] |= (uint64_t)stones[n] << (n & 63);
+            if(unvisited[n]) {
+                unvisited.reset(n);
+                v2 p = {el.x + neighbour_deltas[d].x, el.y + neighbour_deltas[d].y};
+                visited[p.x][p.y] = true;
+                queue[tail++] = p;
             }
         }
     }
 
+    bool black_wall = (walls & ~colors).any();
+    bool white_wall = (walls & colors).any();
+    if(black_wall) wall_type = STONE_BLACK;
+    if(white_wall) wall_type = STONE_WHITE;
+    if(black_wall && white_wall) assign_points = false;
+
     if(assign_points) {
         if(wall_type == STONE_WHITE)
             *white_points += region_size;
@@ -261,17 +874,29 @@ Stone GameData::winner(float *black_points, float *white_points) {
 
     // two passes in a row, we need to count the score
 
-    bool visited[19][19] = {};
     float white_score = 0;
     float black_score = 0;
     if(!white_points) white_points = &white_score;
     if(!black_points) black_points = &black_score;
+#if GO_CAPTURE_ENGINE == GO_ENGINE_BFS
+    bool visited[19][19] = {};
     for(int i = 0; i < board.size; i++) {
         for(int j = 0; j < board.size; j++) {
             if(!visited[i][j])
                 board.count_region(i, j, visited, black_points, white_points);
         }
     }
+#else
+    int black_territory, white_territory;
+    switch(board.size) {
+        case 9:  count_territory<9>(&board, &black_territory, &white_territory); break;
+        case 13: count_territory<13>(&board, &black_territory, &white_territory); break;
+        case 19: count_territory<19>(&board, &black_territory, &white_territory); break;
+        default: count_territory<0>(&board, &black_territory, &white_territory); break;
+    }
+    *black_points += black_territory;
+    *white_points += white_territory;
+#endif
 
     for(int i = 0; i < log.move_count; i++) {
         if(i % 2)
@@ -280,9 +905,7 @@ Stone GameData::winner(float *black_points, float *white_points) {
             *black_points += log.removed_count[i];
     }
 
-    float komi = 3.5f;
-    if(board.size > 12) komi = 6.5f;
-    *white_points += komi;
+    *white_points += komi(board.size);
 
     if(*white_points > *black_points) return STONE_WHITE;
     else return STONE_BLACK;
@@ -291,7 +914,7 @@ Stone GameData::winner(float *black_points, float *white_points) {
 void GameData::redo_move() {
     if(log.last_valid_move_count == log.move_count)
         return;
-    v2_8 _v = log.moves[log.move_count++];
+    v2_8 _v = log.moves[log.move_count];
     v2 v = {(int32_t)_v.x, (int32_t)_v.y};
     maybe_make_move(v.x, v.y);
 }
@@ -1,11 +1,42 @@
 #pragma once
 
-#include <bitset>
-#include <queue>
-#include <vector>
 #include <stdint.h>
 
 #define MAX_BOARD_SIZE 19
+// enough room for every point of the largest board, the size of buffers
+// passed to Board::get_group and friends
+#define MAX_BOARD_POINTS (MAX_BOARD_SIZE*MAX_BOARD_SIZE)
+
+// Capture engines for GameData::maybe_make_move. The BFS engine is the
+// original implementation and is kept as a reference for the other ones,
+// all of them produce identical boards and move logs.
+// Build with e.g. -DGO_CAPTURE_ENGINE=GO_ENGINE_BFS to select one.
+#define GO_ENGINE_BFS      0
+#define GO_ENGINE_BITBOARD 1
+// keeps stone chains and their liberties up to date in Board::chains
+#define GO_ENGINE_CHAINS   2
+
+#ifndef GO_CAPTURE_ENGINE
+#define GO_CAPTURE_ENGINE GO_ENGINE_BITBOARD
+#endif
+
+// With positional superko a move may not repeat any earlier position of
+// the game, otherwise only the position before the opponent's last move
+// is forbidden (simple ko).
+#ifndef GO_POSITIONAL_SUPERKO
+#define GO_POSITIONAL_SUPERKO 0
+#endif
+
+// Boards are stored with a border of off-board sentinel points around
+// them: row 0 and row size+1 are off the board and so is column 0, which
+// also serves as the right edge of the row before it. Point (i, j) lives
+// at index (i+1)*(size+1) + j+1, so every point on the board has its four
+// neighbours at fixed offsets and none of them falls outside the arrays.
+#define BOARD_STRIDE(size) ((size)+1)
+#define BOARD_CELLS_FOR(size) (((size)+2)*BOARD_STRIDE(size))
+#define BITBOARD_WORDS_FOR(size) ((BOARD_CELLS_FOR(size)+63)/64)
+#define BOARD_CELLS BOARD_CELLS_FOR(MAX_BOARD_SIZE)
+#define BITBOARD_WORDS BITBOARD_WORDS_FOR(MAX_BOARD_SIZE)
 
 struct v2 { int32_t x; int32_t y; };
 struct v2_8 { int8_t x; int8_t y; };
@@ -18,17 +49,156 @@ enum Stone {
 
 inline Stone other_stone_color(Stone s);
 
+// W words of bits, Board always uses the widest one while FixedBoard<N>
+// only carries as many words as its size needs
+template <int W>
+struct BitboardN {
+    uint64_t words[W];
+
+    bool operator[](int i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+    void set(int i)   { words[i >> 6] |=  ((uint64_t)1 << (i & 63)); }
+    void reset(int i) { words[i >> 6] &= ~((uint64_t)1 << (i & 63)); }
+
+    bool any() const {
+        uint64_t r = 0;
+        for(int w = 0; w < W; w++) r |= words[w];
+        return r != 0;
+    }
+
+    int count() const {
+        int r = 0;
+        for(int w = 0; w < W; w++) r += __builtin_popcountll(words[w]);
+        return r;
+    }
+
+    // index of the lowest set bit, -1 if empty
+    int first() const {
+        for(int w = 0; w < W; w++)
+            if(words[w]) return w*64 + __builtin_ctzll(words[w]);
+        return -1;
+    }
+};
+
+typedef BitboardN<BITBOARD_WORDS> Bitboard;
+
+template <int W>
+inline BitboardN<W> operator&(BitboardN<W> a, BitboardN<W> b) {
+    for(int w = 0; w < W; w++) a.words[w] &= b.words[w];
+    return a;
+}
+
+template <int W>
+inline BitboardN<W> operator|(BitboardN<W> a, BitboardN<W> b) {
+    for(int w = 0; w < W; w++) a.words[w] |= b.words[w];
+    return a;
+}
+
+template <int W>
+inline BitboardN<W> operator^(BitboardN<W> a, BitboardN<W> b) {
+    for(int w = 0; w < W; w++) a.words[w] ^= b.words[w];
+    return a;
+}
+
+template <int W>
+inline BitboardN<W> operator~(BitboardN<W> a) {
+    for(int w = 0; w < W; w++) a.words[w] = ~a.words[w];
+    return a;
+}
+
+template <int W>
+inline BitboardN<W> &operator&=(BitboardN<W> &a, BitboardN<W> b) { return a = a & b; }
+template <int W>
+inline BitboardN<W> &operator|=(BitboardN<W> &a, BitboardN<W> b) { return a = a | b; }
+
+template <int W>
+inline bool operator==(BitboardN<W> a, BitboardN<W> b) {
+    uint64_t r = 0;
+    for(int w = 0; w < W; w++) r |= a.words[w] ^ b.words[w];
+    return r == 0;
+}
+
+template <int W>
+inline bool operator!=(BitboardN<W> a, BitboardN<W> b) { return !(a == b); }
+
+// shifts for 0 < n < 64, bits shifted past either end are dropped
+template <int W>
+inline BitboardN<W> operator<<(BitboardN<W> a, int n) {
+    for(int w = W-1; w > 0; w--)
+        a.words[w] = (a.words[w] << n) | (a.words[w-1] >> (64-n));
+    a.words[0] <<= n;
+    return a;
+}
+
+template <int W>
+inline BitboardN<W> operator>>(BitboardN<W> a, int n) {
+    for(int w = 0; w < W-1; w++)
+        a.words[w] = (a.words[w] >> n) | (a.words[w+1] << (64-n));
+    a.words[W-1] >>= n;
+    return a;
+}
+
+// Per chain data is only valid at the chain's head. Liberties are counted
+// as pseudo-liberties: one for every (stone, empty neighbour) pair. The
+// count is zero exactly when the chain has no liberties, and the sums
+// tell whether all of them are the same point, i.e. the chain is in atari.
+struct Chain {
+    int16_t stone_count;
+    int16_t liberties;
+    int32_t liberty_sum;
+    int32_t liberty_sum_sq;
+};
+
+struct ChainIndex {
+    // head+1 of the chain the stone belongs to, 0 for empty points
+    // so that a zeroed Board is a valid empty board
+    int16_t head[BOARD_CELLS];
+    // circular list of the stones in a chain
+    int16_t next[BOARD_CELLS];
+    Chain   chains[BOARD_CELLS];
+};
+
 struct Board {
-    std::bitset<384> stones;
-    std::bitset<384> colors;
+    Bitboard stones;
+    Bitboard colors;
     int32_t size;
+    // zobrist hash of the position, kept up to date by set()
+    uint64_t hash;
+#if GO_CAPTURE_ENGINE == GO_ENGINE_CHAINS
+    ChainIndex chains;
+#endif
 
     Stone stone(int i, int j);
     void set(int i, int j, Stone s);
-    std::vector<v2> get_group(int i, int j);
-    int count_liberties(std::vector<v2> group);
+
+    int index(int i, int j) { return (i+1)*BOARD_STRIDE(size) + j+1; }
+    v2 point(int k) { return {k / BOARD_STRIDE(size) - 1, k % BOARD_STRIDE(size) - 1}; }
+
+    // bit-parallel helpers, all results are restricted to the board
+    Bitboard on_board();
+    Bitboard stones_of(Stone s);
+    Bitboard neighbours(Bitboard b);
+    Bitboard flood(Bitboard seed, Bitboard mask);
+
+    // writes the group into a buffer of MAX_BOARD_POINTS elements,
+    // returns the number of stones in it
+    int get_group(int i, int j, v2 *group);
+    int count_liberties(v2 *group, int group_size);
     void count_region(int i, int j, bool visited[19][19],
                       float *black_points, float *white_points);
+
+#if GO_CAPTURE_ENGINE == GO_ENGINE_CHAINS
+    // chain head of the stone at index k, -1 for an empty or off-board point
+    int chain_head(int k) { return chains.head[k] - 1; }
+    // the only liberty of a chain, -1 if it has none or more than one
+    int atari_point(int head);
+    bool in_atari(int i, int j);
+    // removes every stone of the chain and adds them to removed
+    void remove_chain(int head, Bitboard *removed);
+
+    void chain_add_stone(int k);
+    void chain_remove_stone(int k);
+    void chain_rebuild(int k);
+#endif
 };
 
 struct MoveLog {
@@ -44,8 +214,52 @@ struct MoveLog {
     // list of all removed stones
     v2_8    removed[512];
 
-    void register_move(int i, int j);
-    void register_remove(std::vector<v2> stones);
+    // for each move, the board hash after it was made
+    uint64_t hashes[512];
+
+    void register_move(int i, int j, uint64_t hash);
+    void register_remove(v2 *stones, int count);
+    // hash of the position after the first n moves
+    uint64_t position_hash(int n);
+};
+
+// Board and game state for one board size known at compile time, for bots
+// and playouts that don't need the move log. Bitboards are only as wide as
+// the size needs, a 9x9 FixedGame fits in a single cache line. Indexing,
+// hashing and the capture rules are the same as for Board and GameData,
+// but only simple ko is checked since there is no position history.
+template <int N>
+struct FixedBoard {
+    static constexpr int words = BITBOARD_WORDS_FOR(N);
+
+    BitboardN<words> stones;
+    BitboardN<words> colors;
+    uint64_t hash;
+
+    static int index(int i, int j) { return (i+1)*BOARD_STRIDE(N) + j+1; }
+    static BitboardN<words> on_board();
+    Stone stone(int i, int j) {
+        int k = index(i, j);
+        return (Stone)(stones[k] | (colors[k] << 1));
+    }
+};
+
+template <int N>
+struct FixedGame {
+    FixedBoard<N> board;
+    // hash of the position before the last move, a move may not recreate it
+    uint64_t previous_hash;
+    int16_t move_count;
+    // stones captured by black and by white
+    int16_t captures[2];
+    int8_t consecutive_passes;
+
+    bool active_player() { return (bool)(move_count & 0x1); }
+    bool maybe_make_move(int i, int j);
+    bool pass();
+    BitboardN<FixedBoard<N>::words> legal_moves();
+    // scored the same way as GameData::winner once both players passed
+    Stone winner(float *black_points = 0, float *white_points = 0);
 };
 
 struct GameData {
@@ -54,6 +268,11 @@ struct GameData {
 
     bool active_player();
     bool maybe_make_move(int i, int j);
+    // every point the player to move may play at, suicide and ko already
+    // excluded, indexed with Board::index
+    Bitboard legal_moves();
+    // whether a move leading to this position breaks the ko rule
+    bool repeats_position(uint64_t hash);
     bool pass();
     bool resign();
     Stone winner(float *black_points = 0, float *white_points = 0);
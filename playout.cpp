@@ -0,0 +1,143 @@
+#include "playout.h"
+#include <cassert>
+
+// xorshift64*, fast and good enough to pick moves
+static uint64_t next_random(uint64_t *rng) {
+    uint64_t x = *rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *rng = x;
+    return x * 0x2545f4914f6cdd1d;
+}
+
+// index of the n-th lowest set bit, b must have more than n bits set
+template <int W>
+static int nth_bit(BitboardN<W> b, int n) {
+    for(int w = 0; w < W; w++) {
+        uint64_t word = b.words[w];
+        int count = __builtin_popcountll(word);
+        if(n >= count) {
+            n -= count;
+            continue;
+        }
+        for(; n > 0; n--) word &= word - 1;
+        return w*64 + __builtin_ctzll(word);
+    }
+    return -1;
+}
+
+template <int W>
+static BitboardN<W> eyes_of(BitboardN<W> stones, BitboardN<W> colors,
+                            BitboardN<W> on_board, int stride, Stone s) {
+    BitboardN<W> off_board = ~on_board;
+    BitboardN<W> enemy = stones & (s == STONE_WHITE ? ~colors : colors);
+    BitboardN<W> walls = (stones & (s == STONE_WHITE ? colors : ~colors)) | off_board;
+
+    BitboardN<W> eyes = on_board & ~stones;
+    eyes &= (walls >> 1) & (walls << 1) & (walls >> stride) & (walls << stride);
+
+    BitboardN<W> edge = (off_board >> 1) | (off_board << 1) | (off_board >> stride) | (off_board << stride);
+
+    // enemy stones on the diagonals, counted up to two
+    BitboardN<W> diagonals[4] = {
+        enemy >> (stride-1), enemy << (stride-1),
+        enemy >> (stride+1), enemy << (stride+1),
+    };
+    BitboardN<W> one = {}, two = {};
+    for(int d = 0; d < 4; d++) {
+        two |= one & diagonals[d];
+        one |= diagonals[d];
+    }
+
+    return eyes & ~two & ~(edge & one);
+}
+
+Bitboard own_eyes(Board *board, Stone s) {
+    return eyes_of(board->stones, board->colors, board->on_board(),
+                   BOARD_STRIDE(board->size), s);
+}
+
+// Trying random candidates until one is accepted is still uniform over the
+// legal ones and much cheaper than building the legal move mask, most
+// empty points are legal. Candidates are the same bits for both games, so
+// the same random numbers pick the same moves.
+template <typename Game, typename Bits>
+static void play_random_candidate(Game *game, Bits moves, int stride, uint64_t *rng) {
+    for(int count = moves.count(); count > 0; count--) {
+        int k = nth_bit(moves, next_random(rng) % count);
+        if(game->maybe_make_move(k / stride - 1, k % stride - 1))
+            return;
+        moves.reset(k);
+    }
+    game->pass();
+}
+
+void play_random_move(GameData *game, uint64_t *rng) {
+    Stone s = game->active_player() ? STONE_WHITE : STONE_BLACK;
+    Board *board = &game->board;
+    Bitboard moves = board->stones_of(STONE_NONE) & ~own_eyes(board, s);
+    play_random_candidate(game, moves, BOARD_STRIDE(board->size), rng);
+}
+
+template <int N>
+void play_random_move(FixedGame<N> *game, uint64_t *rng) {
+    Stone s = game->active_player() ? STONE_WHITE : STONE_BLACK;
+    FixedBoard<N> *board = &game->board;
+    auto on_board = FixedBoard<N>::on_board();
+    auto moves = on_board & ~board->stones &
+                 ~eyes_of(board->stones, board->colors, on_board, BOARD_STRIDE(N), s);
+    play_random_candidate(game, moves, BOARD_STRIDE(N), rng);
+}
+
+// leave room for the two closing passes, and never make a move that could
+// capture more stones than the log can still hold
+static bool log_is_full(int move_count, int removed_count, int max_captures) {
+    int capacity = sizeof(MoveLog::moves) / sizeof(MoveLog::moves[0]);
+    int removed_capacity = sizeof(MoveLog::removed) / sizeof(MoveLog::removed[0]);
+    return move_count + 2 >= capacity || removed_count + max_captures > removed_capacity;
+}
+
+Stone playout(GameData *game, uint64_t *rng, float *black_points, float *white_points) {
+    MoveLog *log = &game->log;
+    for(;;) {
+        int n = log->move_count;
+        if(n >= 2 && log->moves[n-1].x == -1 && log->moves[n-2].x == -1)
+            break;
+
+        Stone opponent = game->active_player() ? STONE_BLACK : STONE_WHITE;
+        int max_captures = game->board.stones_of(opponent).count();
+        if(log_is_full(n, log->removed_count_total, max_captures)) {
+            game->pass();
+            continue;
+        }
+
+        play_random_move(game, rng);
+    }
+
+    return game->winner(black_points, white_points);
+}
+
+template <int N>
+Stone playout(FixedGame<N> *game, uint64_t *rng, float *black_points, float *white_points) {
+    FixedBoard<N> *board = &game->board;
+    while(game->consecutive_passes < 2) {
+        auto opponent = board->stones & (game->active_player() ? ~board->colors : board->colors);
+        int removed = game->captures[0] + game->captures[1];
+        if(log_is_full(game->move_count, removed, opponent.count())) {
+            game->pass();
+            continue;
+        }
+
+        play_random_move(game, rng);
+    }
+
+    return game->winner(black_points, white_points);
+}
+
+template void play_random_move(FixedGame<9> *game, uint64_t *rng);
+template void play_random_move(FixedGame<13> *game, uint64_t *rng);
+template void play_random_move(FixedGame<19> *game, uint64_t *rng);
+template Stone playout(FixedGame<9> *game, uint64_t *rng, float *black_points, float *white_points);
+template Stone playout(FixedGame<13> *game, uint64_t *rng, float *black_points, float *white_points);
+template Stone playout(FixedGame<19> *game, uint64_t *rng, float *black_points, float *white_points);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "game_logic.h"
+
+// Light random playouts: both players play uniformly random legal moves,
+// never filling their own eyes, until neither has a move left and both
+// pass. The game is then scored with GameData::winner, or FixedGame::winner
+// for a FixedGame. Both play the same game from the same seed.
+
+// own eyes of the given color: empty points whose neighbours are all own
+// stones and with at most one enemy stone on the diagonals, none for
+// points on the edge of the board
+Bitboard own_eyes(Board *board, Stone s);
+
+// plays a random legal move that doesn't fill an own eye, passes if there
+// is none. rng is the state of the random number generator, any value but
+// zero is a valid seed
+void play_random_move(GameData *game, uint64_t *rng);
+template <int N>
+void play_random_move(FixedGame<N> *game, uint64_t *rng);
+
+// plays the game out in place and returns the winner. Games that would
+// overflow the MoveLog are cut short and scored as they stand, FixedGame
+// playouts are cut at the same point although they keep no log.
+Stone playout(GameData *game, uint64_t *rng,
+              float *black_points = 0, float *white_points = 0);
+template <int N>
+Stone playout(FixedGame<N> *game, uint64_t *rng,
+              float *black_points = 0, float *white_points = 0);
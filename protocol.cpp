@@ -3,7 +3,7 @@
 int read_size(int connection, void *data, size_t size) {
     size_t bytes_read = 0;
     while(bytes_read < size) {
-        int bytes = read(connection, data, size - bytes_read);
+        int bytes = read(connection, (uint8_t *)data + bytes_read, size - bytes_read);
         if(bytes == -1 || bytes == 0) return -1;
         bytes_read += (size_t)bytes;
     }
@@ -13,7 +13,7 @@ int read_size(int connection, void *data, size_t size) {
 int write_size(int connection, void *data, size_t size) {
     size_t bytes_written = 0;
     while(bytes_written < size) {
-        int bytes = write(connection, data, size - bytes_written);
+        int bytes = write(connection, (uint8_t *)data + bytes_written, size - bytes_written);
         if(bytes == -1) return -1;
         bytes_written += (size_t)bytes;
     }
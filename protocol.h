@@ -17,7 +17,15 @@ enum RequestType {
     REQUEST_LEAVE_ROOM,
     REQUEST_MAKE_MOVE,
     REQUEST_LIST_ROOMS,
-    REQUEST_EXIT
+    REQUEST_EXIT,
+    // RESPONSE_LIST_ROOMS for the list_rooms query, then a RESPONSE_LOBBY_EVENT
+    // for every change to any room until REQUEST_UNSUBSCRIBE_LOBBY. Subscribing
+    // again only sends the listing.
+    REQUEST_SUBSCRIBE_LOBBY,
+    REQUEST_UNSUBSCRIBE_LOBBY,
+    // RESPONSE_SPECTATE_SNAPSHOT of the join_room room, then its moves and
+    // RESPONSE_SPECTATE_END once the game is over. Room 0 stops watching.
+    REQUEST_SPECTATE_ROOM,
 };
 
 struct RequestNewRoom {
@@ -33,6 +41,26 @@ struct RequestMakeMove {
     v2_8 move;
 };
 
+enum ListRoomsFlags {
+    LIST_ROOMS_JOINABLE_ONLY = 0x1,
+    // rooms are sent without their boards
+    LIST_ROOMS_NO_BOARDS     = 0x2,
+};
+
+// A zeroed request lists every room. Rooms are listed in the order of
+// their slots on the server, or of their names when a name prefix is
+// given.
+struct RequestListRooms {
+    int32_t offset;
+    // 0 for no limit
+    int16_t limit;
+    // 0 for every size
+    int8_t  board_size;
+    uint8_t flags;
+    // zero padded, empty for every name
+    char    name_prefix[12];
+};
+
 
 struct Request {
     RequestType type;
@@ -40,6 +68,7 @@ struct Request {
         RequestNewRoom  new_room;
         RequestJoinRoom join_room;
         RequestMakeMove make_move;
+        RequestListRooms list_rooms;
     };
 };
 
@@ -52,11 +81,16 @@ enum ResponseType {
     RESPONSE_LIST_ROOMS,
     RESPONSE_ILLEGAL_MOVE,
     RESPONSE_EXIT,
+    RESPONSE_LOBBY_EVENT,
+    RESPONSE_SPECTATE_SNAPSHOT,
+    RESPONSE_SPECTATE_END,
 };
 
 struct ResponseNewMove {
     int32_t room_id;
     v2_8 move;
+    // moves made in the room before this one
+    int16_t move_number;
 };
 
 struct ResponseNewRoomResult {
@@ -67,8 +101,38 @@ struct ResponseJoinResult {
     bool success;
 };
 
+// followed by size rooms: their id, 16 bytes of name, whether they can be
+// joined as a bool and their Board unless LIST_ROOMS_NO_BOARDS was asked
 struct ResponseListRooms {
     int32_t size;
+    // rooms matching the request, offset and limit aside
+    int32_t total;
+};
+
+enum LobbyEventType {
+    // followed by 16 bytes of name, the board is empty
+    LOBBY_ROOM_ADDED = 1,
+    LOBBY_ROOM_FULL,
+    LOBBY_ROOM_CLOSED,
+    // followed by the room's Board after a move
+    LOBBY_ROOM_BOARD,
+};
+
+struct ResponseLobbyEvent {
+    int32_t room_id;
+    // LobbyEventType
+    uint8_t event;
+    int8_t  board_size;
+};
+
+// The snapshot is followed by the move_count moves made so far as v2_8,
+// replaying them gives the game. Its room_id is 0 when the room can't be
+// watched. Moves in the snapshot may be sent again, spectators skip the
+// ones with a move_number below the snapshot's move_count.
+struct ResponseSpectate {
+    int32_t room_id;
+    int16_t move_count;
+    int8_t  board_size;
 };
 
 struct Response {
@@ -78,6 +142,8 @@ struct Response {
         ResponseNewRoomResult new_room_result;
         ResponseJoinResult join_result;
         ResponseListRooms list_rooms;
+        ResponseLobbyEvent lobby_event;
+        ResponseSpectate spectate;
     };
 };
 
@@ -0,0 +1,366 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "server.h"
+
+#define MAX_EVENTS 256
+
+// epoll data of the listening socket and of the mailbox wakeup, clients
+// use client_event_data and their indices start at 1
+#define LISTENING_SOCKET ((uint64_t)0)
+#define MAILBOX ((uint64_t)-1)
+// client indices of lobby and spectator events in the mailbox
+#define LOBBY_EVENT 0
+#define SPECTATOR_EVENT -1
+// message size of a client's resume, nothing follows the header
+#define RESUME_CLIENT -1
+
+EventLoop loops[MAX_EVENT_LOOPS];
+static int loop_count = 0;
+// epoll instance of the flusher thread, see start_flusher
+static int flusher_descriptor = -1;
+// loop of the calling thread, -1 outside of the event loops
+static thread_local int current_loop = -1;
+
+static void set_nonblocking(int desc) {
+    int flags = fcntl(desc, F_GETFL, 0);
+    fcntl(desc, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void watch(EventLoop *loop, int op, int desc, uint32_t events, uint64_t data) {
+    epoll_event event = {};
+    event.events = events;
+    event.data.u64 = data;
+    count_syscalls(1);
+    if(epoll_ctl(loop->epoll_descriptor, op, desc, &event)) {
+        printf("Error in epoll_ctl: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+void wait_for_output(Client *client) {
+    if(client->waiting_for_output) return;
+    client->waiting_for_output = true;
+    int client_index = (int)(client - &clients[0]);
+    if(server_mode == SERVER_THREADS) {
+        // the socket stays in the flusher's set once added, one shot
+        // events only disable it until it is armed again
+        epoll_event event = {};
+        event.events = EPOLLOUT | EPOLLONESHOT;
+        event.data.u64 = client_event_data(client_index);
+        count_syscalls(1);
+        if(epoll_ctl(flusher_descriptor, EPOLL_CTL_MOD, client->connection.desc, &event) == 0)
+            return;
+        count_syscalls(1);
+        if(epoll_ctl(flusher_descriptor, EPOLL_CTL_ADD, client->connection.desc, &event)) {
+            printf("Error in epoll_ctl: %s\n", strerror(errno));
+            exit(1);
+        }
+        return;
+    }
+    watch(&loops[client->loop], EPOLL_CTL_MOD, client->connection.desc,
+          EPOLLIN | EPOLLOUT | EPOLLRDHUP, client_event_data(client_index));
+}
+
+static void *run_flusher(void *) {
+    epoll_event events[MAX_EVENTS];
+    while(1) {
+        int count = epoll_wait(flusher_descriptor, events, MAX_EVENTS, -1);
+        count_syscalls(1);
+        if(count < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "Error in epoll_wait: %s\n", strerror(errno));
+            exit(1);
+        }
+        for(int it = 0; it < count; it++) {
+            uint64_t data = events[it].data.u64;
+            Client *client = &clients[(int)(uint32_t)data];
+            pthread_mutex_lock(&client->connection.mutex);
+            // the slot may have been taken by a new client meanwhile, it
+            // waits for output on its own
+            if(client->slot.generation == (uint32_t)(data >> 32)) {
+                client->waiting_for_output = false;
+                client_flush(client);
+            }
+            pthread_mutex_unlock(&client->connection.mutex);
+        }
+    }
+    return 0;
+}
+
+void start_flusher() {
+    flusher_descriptor = epoll_create1(0);
+    if(flusher_descriptor < 0) {
+        fprintf(stderr, "Error while creating the flusher: %s\n", strerror(errno));
+        exit(1);
+    }
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, run_flusher, NULL);
+    if(err) {
+        printf("Error while creating a thread: %d\n", err);
+        exit(-1);
+    }
+    pthread_detach(thread);
+}
+
+// appends a message to the loop's mailbox, header[2] is its size unless
+// it is RESUME_CLIENT
+static void post_header(EventLoop *loop, int32_t header[3], void *data, size_t size) {
+    pthread_mutex_lock(&loop->mailbox_mutex);
+    // a loop with mail already has a wakeup pending
+    bool wake_up = loop->mailbox.size == 0;
+    buffer_append(&loop->mailbox, header, 3 * sizeof(int32_t));
+    if(size) buffer_append(&loop->mailbox, data, size);
+    pthread_mutex_unlock(&loop->mailbox_mutex);
+
+    if(wake_up) {
+        uint64_t one = 1;
+        ssize_t bytes = write(loop->wakeup_descriptor, &one, sizeof(one));
+        count_syscalls(1);
+        (void)bytes;
+    }
+}
+
+static void post_mail(EventLoop *loop, int32_t client_index, uint32_t generation,
+                      void *data, size_t size) {
+    int32_t header[3] = {client_index, (int32_t)generation, (int32_t)size};
+    post_header(loop, header, data, size);
+}
+
+bool post_to_event_loop(Client *client, uint32_t generation, void *data, size_t size) {
+    if(client->loop == current_loop || client->connection.desc <= 0)
+        return false;
+    // delivered only if the client is still in the slot by then
+    post_mail(&loops[client->loop], (int32_t)(client - &clients[0]), generation, data, size);
+    return true;
+}
+
+void post_resume(Client *client, uint32_t generation) {
+    int32_t header[3] = {(int32_t)(client - &clients[0]), (int32_t)generation, RESUME_CLIENT};
+    post_header(&loops[client->loop], header, NULL, 0);
+}
+
+// The calling thread's loop may hand out an event itself, unless events
+// posted earlier are still waiting in its mailbox, it would get ahead of
+// them.
+static bool can_deliver_now(int loop) {
+    if(loop != current_loop) return false;
+    pthread_mutex_lock(&loops[loop].mailbox_mutex);
+    bool empty = loops[loop].mailbox.size == 0;
+    pthread_mutex_unlock(&loops[loop].mailbox_mutex);
+    return empty;
+}
+
+bool post_spectator_event(int loop, void *mail, size_t size) {
+    if(can_deliver_now(loop)) return false;
+    post_mail(&loops[loop], SPECTATOR_EVENT, 0, mail, size);
+    return true;
+}
+
+bool post_lobby_event(int loop, SharedMessage *message) {
+    if(can_deliver_now(loop)) return false;
+    __atomic_add_fetch(&message->refs, 1, __ATOMIC_RELAXED);
+    // only the pointer is posted, client 0 marks it as a lobby event
+    post_mail(&loops[loop], LOBBY_EVENT, 0, &message, sizeof(message));
+    return true;
+}
+
+void deliver_mail(EventLoop *loop) {
+    pthread_mutex_lock(&loop->mailbox_mutex);
+    OutputBuffer mail = loop->mailbox;
+    loop->mailbox = loop->delivering;
+    pthread_mutex_unlock(&loop->mailbox_mutex);
+
+    // queue everything first, so a client with several messages gets
+    // them in one write
+    for(int pass = 0; pass < 2; pass++) {
+        for(int32_t at = 0; at < mail.size;) {
+            int32_t header[3];
+            memcpy(header, mail.data + at, sizeof(header));
+            at += sizeof(header);
+            if(header[0] == LOBBY_EVENT) {
+                SharedMessage *message;
+                memcpy(&message, mail.data + at, sizeof(message));
+                lobby_deliver(loop->index, message, pass == 1);
+                if(pass == 1) shared_message_release(message);
+                at += header[2];
+                continue;
+            }
+            if(header[0] == SPECTATOR_EVENT) {
+                SharedMessage *message;
+                memcpy(&message, mail.data + at, sizeof(message));
+                int32_t count = (header[2] - (int32_t)sizeof(message)) / (int32_t)sizeof(PostedSpectator);
+                spectate_deliver(loop->index, message, mail.data + at + sizeof(message), count, pass == 1);
+                if(pass == 1) shared_message_release(message);
+                at += header[2];
+                continue;
+            }
+            if(header[2] == RESUME_CLIENT) {
+                // the replies posted before it are queued, the held
+                // requests' replies go after them
+                if(pass == 0) client_resume(header[0], (uint32_t)header[1]);
+                continue;
+            }
+            Client *client = &clients[header[0]];
+            // the client may have left since the message was posted, and
+            // its slot may have been taken by a new client
+            if(client->slot.generation == (uint32_t)header[1] && client->connection.desc > 0) {
+                pthread_mutex_lock(&client->connection.mutex);
+                if(pass == 0) client_queue(client, mail.data + at, header[2]);
+                else          client_flush(client);
+                pthread_mutex_unlock(&client->connection.mutex);
+            }
+            at += header[2];
+        }
+    }
+
+    mail.size = 0;
+    loop->delivering = mail;
+}
+
+static void accept_clients(EventLoop *loop) {
+    while(1) {
+        int desc = accept(loop->listening_descriptor, NULL, NULL);
+        count_syscalls(1);
+        if(desc < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+            fprintf(stderr, "Error while trying to accept an incoming connection: %s\n", strerror(errno));
+            return;
+        }
+        set_nonblocking(desc);
+        count_syscalls(2);
+        int client_index = client_open(desc, loop->index);
+        printf("accepted connection %d on event loop %d\n", client_index, loop->index);
+        watch(loop, EPOLL_CTL_ADD, desc, EPOLLIN | EPOLLRDHUP, client_event_data(client_index));
+    }
+}
+
+// reads whatever arrived and handles every complete request, returns false
+// once the client should be disconnected
+static bool read_requests(int client_index) {
+    while(1) {
+        bool more;
+        ssize_t bytes = client_receive(client_index, &more);
+        if(bytes == -1 && errno == EINTR) continue;
+        if(bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if(bytes <= 0) return false;
+        // the socket was drained, epoll reports any bytes that arrive later
+        if(!more) return true;
+    }
+}
+
+static void write_output(EventLoop *loop, int client_index) {
+    Client *client = &clients[client_index];
+    pthread_mutex_lock(&client->connection.mutex);
+    client->waiting_for_output = false;
+    watch(loop, EPOLL_CTL_MOD, client->connection.desc, EPOLLIN | EPOLLRDHUP, client_event_data(client_index));
+    // waits for output again if the socket still can't take all of it
+    client_flush(client);
+    pthread_mutex_unlock(&client->connection.mutex);
+}
+
+static void run_epoll_loop(EventLoop *loop) {
+    epoll_event events[MAX_EVENTS];
+    while(1) {
+        int count = epoll_wait(loop->epoll_descriptor, events, MAX_EVENTS, -1);
+        count_syscalls(1);
+        if(count < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "Error in epoll_wait: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        for(int it = 0; it < count; it++) {
+            uint64_t data = events[it].data.u64;
+            uint32_t flags = events[it].events;
+            if(data == LISTENING_SOCKET) {
+                accept_clients(loop);
+                continue;
+            }
+            if(data == MAILBOX) {
+                uint64_t wakeups;
+                ssize_t bytes = read(loop->wakeup_descriptor, &wakeups, sizeof(wakeups));
+                count_syscalls(1);
+                (void)bytes;
+                deliver_mail(loop);
+                continue;
+            }
+
+            int client_index = (int)(uint32_t)data;
+            // closed by an earlier event of this batch, maybe even
+            // replaced by a client accepted in it
+            if(clients[client_index].slot.generation != (uint32_t)(data >> 32) ||
+               clients[client_index].connection.desc <= 0) continue;
+
+            bool open = true;
+            if(flags & EPOLLOUT) write_output(loop, client_index);
+            if(flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                open = read_requests(client_index);
+            if(!open) {
+                printf("closing connection %d\n", client_index);
+                client_close(client_index);
+            }
+        }
+    }
+}
+
+static void *run_event_loop(void *data) {
+    EventLoop *loop = (EventLoop *)data;
+    current_loop = loop->index;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    CPU_SET(loop->index % (cores > 0 ? cores : 1), &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if(err) printf("event loop %d runs unpinned: %s\n", loop->index, strerror(err));
+
+    if(server_mode == SERVER_URING)
+        run_uring_loop(loop);
+    else
+        run_epoll_loop(loop);
+    return 0;
+}
+
+void run_event_loops(int count) {
+    loop_count = count;
+    for(int i = 0; i < loop_count; i++) {
+        EventLoop *loop = &loops[i];
+        loop->index = i;
+        pthread_mutex_init(&loop->mailbox_mutex, NULL);
+        // io_uring reads the eventfd with a request in flight, which only
+        // waits for data on a blocking descriptor
+        loop->wakeup_descriptor = eventfd(0, server_mode == SERVER_URING ? 0 : EFD_NONBLOCK);
+        if(loop->wakeup_descriptor < 0) {
+            fprintf(stderr, "Error while creating event loop %d: %s\n", i, strerror(errno));
+            exit(1);
+        }
+        loop->listening_descriptor = open_server_socket(loop_count > 1);
+        // the io_uring loops set up their rings on their own threads
+        if(server_mode == SERVER_URING) continue;
+
+        loop->epoll_descriptor = epoll_create1(0);
+        if(loop->epoll_descriptor < 0) {
+            fprintf(stderr, "Error while creating event loop %d: %s\n", i, strerror(errno));
+            exit(1);
+        }
+        set_nonblocking(loop->listening_descriptor);
+        watch(loop, EPOLL_CTL_ADD, loop->listening_descriptor, EPOLLIN, LISTENING_SOCKET);
+        watch(loop, EPOLL_CTL_ADD, loop->wakeup_descriptor, EPOLLIN, MAILBOX);
+    }
+
+    // the calling thread becomes the first loop
+    for(int i = 1; i < loop_count; i++) {
+        int err = pthread_create(&loops[i].thread, NULL, run_event_loop, &loops[i]);
+        if(err) {
+            printf("Error while creating a thread: %d\n", err);
+            exit(-1);
+        }
+    }
+    run_event_loop(&loops[0]);
+}
@@ -0,0 +1,138 @@
+#include "server.h"
+
+// Clients subscribed to the lobby, kept per event loop so that every loop
+// hands the events to its own clients. With threads all of them are on
+// loop 0 and events are handed out by the thread that made the change.
+struct LobbySubscribers {
+    pthread_mutex_t mutex;
+    int32_t *clients;
+    int32_t count;
+    int32_t capacity;
+};
+
+static LobbySubscribers subscribers[MAX_EVENT_LOOPS];
+// over all loops, events aren't even encoded while it is 0
+static int32_t subscriber_count = 0;
+
+void lobby_subscribe(int client_index, RequestListRooms *query) {
+    Client *client = &clients[client_index];
+    LobbySubscribers *list = &subscribers[client->loop];
+    // the subscribers an event goes to are copied out under the same
+    // mutex, so none of them goes out between the listing and the
+    // subscription. A change the listing already shows may still be
+    // followed by its event, never the other way around.
+    pthread_mutex_lock(&list->mutex);
+    if(!client->lobby_subscriber) {
+        if(list->count == list->capacity) {
+            list->capacity = list->capacity ? list->capacity * 2 : 64;
+            list->clients = (int32_t *)realloc(list->clients, list->capacity * sizeof(int32_t));
+            if(!list->clients) {
+                printf("Error while growing the lobby subscribers to %d clients\n", list->capacity);
+                exit(1);
+            }
+        }
+        client->lobby_subscriber = true;
+        client->lobby_slot = list->count;
+        list->clients[list->count++] = client_index;
+        __atomic_add_fetch(&subscriber_count, 1, __ATOMIC_RELAXED);
+    }
+    send_room_list(client, query);
+    pthread_mutex_unlock(&list->mutex);
+}
+
+void lobby_unsubscribe(int client_index) {
+    Client *client = &clients[client_index];
+    LobbySubscribers *list = &subscribers[client->loop];
+    pthread_mutex_lock(&list->mutex);
+    if(client->lobby_subscriber) {
+        // the last subscriber takes the slot
+        int32_t last = list->clients[--list->count];
+        list->clients[client->lobby_slot] = last;
+        clients[last].lobby_slot = client->lobby_slot;
+        client->lobby_subscriber = false;
+        __atomic_sub_fetch(&subscriber_count, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&list->mutex);
+}
+
+void shared_message_release(SharedMessage *message) {
+    if(__atomic_sub_fetch(&message->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(message->encoded.data);
+        free(message);
+    }
+}
+
+// Copies the loop's subscribers out as their client index and slot
+// generation, so the event is handed to them without holding the list's
+// mutex and a slow subscriber doesn't hold up the next event.
+static int32_t copy_subscribers(int loop, OutputBuffer *out) {
+    LobbySubscribers *list = &subscribers[loop];
+    out->size = 0;
+    pthread_mutex_lock(&list->mutex);
+    for(int32_t i = 0; i < list->count; i++) {
+        int32_t subscriber[2] = {list->clients[i], (int32_t)clients[list->clients[i]].slot.generation};
+        buffer_append(out, subscriber, sizeof(subscriber));
+    }
+    pthread_mutex_unlock(&list->mutex);
+    return out->size / (2 * (int32_t)sizeof(int32_t));
+}
+
+static void deliver_to(OutputBuffer *subscribers, int32_t count, SharedMessage *message,
+                       bool queue, bool flush) {
+    int32_t *subscriber = (int32_t *)subscribers->data;
+    for(int32_t i = 0; i < count; i++, subscriber += 2) {
+        Client *client = &clients[subscriber[0]];
+        pthread_mutex_lock(&client->connection.mutex);
+        // the client may have left since, and a new one taken its slot
+        if(client->slot.generation == (uint32_t)subscriber[1] && client->connection.desc > 0) {
+            if(queue) {
+                client_queue_bulk(client, message->encoded.data, message->encoded.size);
+                client_end_bulk(client);
+            }
+            if(flush) client_flush(client);
+        }
+        pthread_mutex_unlock(&client->connection.mutex);
+    }
+}
+
+void lobby_deliver(int loop, SharedMessage *message, bool flush) {
+    static thread_local OutputBuffer copied;
+    int32_t count = copy_subscribers(loop, &copied);
+    deliver_to(&copied, count, message, !flush, flush);
+}
+
+void lobby_publish(int32_t room_id, int32_t handle, LobbyEventType event, int board_size) {
+    if(__atomic_load_n(&subscriber_count, __ATOMIC_RELAXED) == 0) return;
+
+    // encoded once for every subscriber
+    SharedMessage *message = (SharedMessage *)calloc(1, sizeof(SharedMessage));
+    Response res = {};
+    res.type = RESPONSE_LOBBY_EVENT;
+    res.lobby_event.room_id = handle;
+    res.lobby_event.event = (uint8_t)event;
+    res.lobby_event.board_size = (int8_t)board_size;
+    buffer_append(&message->encoded, &res, sizeof(res));
+    if(event == LOBBY_ROOM_ADDED)
+        buffer_append(&message->encoded, rooms[room_id].name, 16);
+    if(event == LOBBY_ROOM_BOARD)
+        buffer_append(&message->encoded, &games[room_id].board, sizeof(Board));
+
+    // the reference of this function
+    message->refs = 1;
+    if(server_mode == SERVER_THREADS) {
+        // handed out by the room's actor, every subscriber in one go
+        static thread_local OutputBuffer copied;
+        int32_t count = copy_subscribers(0, &copied);
+        deliver_to(&copied, count, message, true, true);
+    } else {
+        // each loop hands it to its own subscribers
+        for(int loop = 0; loop < MAX_EVENT_LOOPS; loop++) {
+            if(__atomic_load_n(&subscribers[loop].count, __ATOMIC_RELAXED) == 0) continue;
+            if(!post_lobby_event(loop, message)) {
+                lobby_deliver(loop, message, false);
+                lobby_deliver(loop, message, true);
+            }
+        }
+    }
+    shared_message_release(message);
+}
@@ -0,0 +1,143 @@
+#include "server.h"
+
+// Requests waiting for a room's actor, indexed by room index like the
+// rooms. A room with mail is on the run queue once, the worker that takes
+// it off hands it a batch and puts it back at the end of the queue if more
+// came meanwhile, so a busy room doesn't keep a worker from the others.
+struct RoomMailbox {
+    pthread_mutex_t mutex;
+    RoomMail *mail;
+    int32_t count;
+    int32_t capacity;
+    bool scheduled;
+};
+
+static SyncDynamicArray<RoomMailbox> mailboxes;
+
+// rooms with mail, in the order they got it
+struct RunQueue {
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    int32_t *rooms;
+    int32_t first;
+    int32_t count;
+    int32_t capacity;
+};
+
+static RunQueue run_queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static RoomMailbox *mailbox_of(int32_t room_id) {
+    if(room_id >= __atomic_load_n(&mailboxes.size, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&mailboxes.mutex);
+        while(mailboxes.size <= room_id) mailboxes.push({});
+        pthread_mutex_unlock(&mailboxes.mutex);
+    }
+    return &mailboxes[room_id];
+}
+
+static void schedule(int32_t room_id) {
+    RunQueue *queue = &run_queue;
+    pthread_mutex_lock(&queue->mutex);
+    if(queue->count == queue->capacity) {
+        // unwrapped into the new space
+        int32_t capacity = queue->capacity ? queue->capacity * 2 : 1024;
+        int32_t *rooms = (int32_t *)malloc(capacity * sizeof(int32_t));
+        if(!rooms) {
+            printf("Error while growing the run queue to %d rooms\n", capacity);
+            exit(1);
+        }
+        for(int32_t i = 0; i < queue->count; i++)
+            rooms[i] = queue->rooms[(queue->first + i) % queue->capacity];
+        free(queue->rooms);
+        queue->rooms = rooms;
+        queue->first = 0;
+        queue->capacity = capacity;
+    }
+    queue->rooms[(queue->first + queue->count) % queue->capacity] = room_id;
+    queue->count++;
+    pthread_mutex_unlock(&queue->mutex);
+    pthread_cond_signal(&queue->ready);
+}
+
+void room_post(int32_t room_id, int client_index, Request *req, uint32_t ticket) {
+    int32_t index = room_index(room_id);
+    if(index == 0) return;
+    RoomMail mail = {};
+    mail.client_index = client_index;
+    mail.client_generation = clients[client_index].slot.generation;
+    mail.room_id = room_id;
+    mail.ticket = ticket;
+    mail.request = *req;
+    // the connection's later requests know what to wait for
+    Client *client = &clients[client_index];
+    client->posted_room_id = room_id;
+    __atomic_store_n(&client->requests_posted, client->requests_posted + 1, __ATOMIC_SEQ_CST);
+
+    RoomMailbox *box = mailbox_of(index);
+    pthread_mutex_lock(&box->mutex);
+    if(box->count == box->capacity) {
+        box->capacity = box->capacity ? box->capacity * 2 : 8;
+        box->mail = (RoomMail *)realloc(box->mail, box->capacity * sizeof(RoomMail));
+        if(!box->mail) {
+            printf("Error while growing the mailbox of room %d to %d requests\n", index, box->capacity);
+            exit(1);
+        }
+    }
+    box->mail[box->count++] = mail;
+    bool wake_up = !box->scheduled;
+    box->scheduled = true;
+    pthread_mutex_unlock(&box->mutex);
+    if(wake_up) schedule(index);
+}
+
+static void *run_room_worker(void *) {
+    // the batch being handled, swapped with the room's mailbox
+    RoomMail *batch = NULL;
+    int32_t batch_capacity = 0;
+    RunQueue *queue = &run_queue;
+    while(1) {
+        pthread_mutex_lock(&queue->mutex);
+        while(queue->count == 0) pthread_cond_wait(&queue->ready, &queue->mutex);
+        int32_t room_id = queue->rooms[queue->first];
+        queue->first = (queue->first + 1) % queue->capacity;
+        queue->count--;
+        pthread_mutex_unlock(&queue->mutex);
+
+        RoomMailbox *box = &mailboxes[room_id];
+        pthread_mutex_lock(&box->mutex);
+        RoomMail *mail = box->mail;
+        int32_t count = box->count;
+        int32_t capacity = box->capacity;
+        box->mail = batch;
+        box->capacity = batch_capacity;
+        box->count = 0;
+        pthread_mutex_unlock(&box->mutex);
+        batch = mail;
+        batch_capacity = capacity;
+
+        for(int32_t i = 0; i < count; i++) {
+            handle_room_mail(room_id, &batch[i]);
+            client_request_done(batch[i].client_index, batch[i].client_generation);
+        }
+
+        // the room stays scheduled while it has mail
+        pthread_mutex_lock(&box->mutex);
+        bool more = box->count > 0;
+        if(!more) box->scheduled = false;
+        pthread_mutex_unlock(&box->mutex);
+        if(more) schedule(room_id);
+    }
+    return 0;
+}
+
+void start_room_workers(int count) {
+    for(int i = 0; i < count; i++) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, run_room_worker, NULL);
+        if(err) {
+            printf("Error while creating a thread: %d\n", err);
+            exit(-1);
+        }
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,240 @@
+#include "server.h"
+
+// Sorted arrays of room ids, one for every listing that doesn't ask for a
+// name prefix, so a page of it is found without looking at other rooms,
+// and every room sorted by name for the prefixes. Each shard indexes its
+// own rooms under its lock.
+struct RoomIds {
+    int32_t *ids;
+    int32_t count;
+    int32_t capacity;
+};
+
+struct RoomIndex {
+    RoomIds all_rooms;
+    RoomIds joinable_rooms;
+    RoomIds rooms_of_size[MAX_BOARD_SIZE+1];
+    RoomIds joinable_rooms_of_size[MAX_BOARD_SIZE+1];
+    RoomIds rooms_by_name;
+};
+
+static RoomIndex indexes[ROOM_SHARDS];
+
+static RoomIndex *index_of(int32_t room_id) {
+    return &indexes[room_id % ROOM_SHARDS];
+}
+
+static bool room_before(int32_t a, int32_t b, bool by_name) {
+    if(by_name) {
+        int order = strncmp(rooms[a].name, rooms[b].name, 16);
+        if(order) return order < 0;
+    }
+    return a < b;
+}
+
+// index of the first room not before room_id
+static int32_t lower_bound(RoomIds *set, int32_t room_id, bool by_name) {
+    int32_t low = 0, high = set->count;
+    while(low < high) {
+        int32_t middle = (low + high) / 2;
+        if(room_before(set->ids[middle], room_id, by_name)) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+static void insert(RoomIds *set, int32_t room_id, bool by_name = false) {
+    if(set->count == set->capacity) {
+        set->capacity = set->capacity ? set->capacity * 2 : 64;
+        set->ids = (int32_t *)realloc(set->ids, set->capacity * sizeof(int32_t));
+        if(!set->ids) {
+            printf("Error while growing a room index to %d rooms\n", set->capacity);
+            exit(1);
+        }
+    }
+    int32_t at = lower_bound(set, room_id, by_name);
+    memmove(set->ids + at + 1, set->ids + at, (set->count - at) * sizeof(int32_t));
+    set->ids[at] = room_id;
+    set->count++;
+}
+
+static void remove(RoomIds *set, int32_t room_id, bool by_name = false) {
+    int32_t at = lower_bound(set, room_id, by_name);
+    if(at == set->count || set->ids[at] != room_id) return;
+    set->count--;
+    memmove(set->ids + at, set->ids + at + 1, (set->count - at) * sizeof(int32_t));
+}
+
+static int board_size_of(int32_t room_id) {
+    int size = rooms[room_id].board_size;
+    assert(size >= 2 && size <= MAX_BOARD_SIZE);
+    return size;
+}
+
+void index_room_added(int32_t room_id) {
+    RoomIndex *index = index_of(room_id);
+    int size = board_size_of(room_id);
+    insert(&index->all_rooms, room_id);
+    insert(&index->rooms_of_size[size], room_id);
+    insert(&index->rooms_by_name, room_id, true);
+    if(rooms[room_id].player_b == 0) {
+        insert(&index->joinable_rooms, room_id);
+        insert(&index->joinable_rooms_of_size[size], room_id);
+    }
+}
+
+void index_room_joined(int32_t room_id) {
+    RoomIndex *index = index_of(room_id);
+    int size = board_size_of(room_id);
+    remove(&index->joinable_rooms, room_id);
+    remove(&index->joinable_rooms_of_size[size], room_id);
+}
+
+void index_room_removed(int32_t room_id) {
+    RoomIndex *index = index_of(room_id);
+    int size = board_size_of(room_id);
+    remove(&index->all_rooms, room_id);
+    remove(&index->rooms_of_size[size], room_id);
+    remove(&index->rooms_by_name, room_id, true);
+    remove(&index->joinable_rooms, room_id);
+    remove(&index->joinable_rooms_of_size[size], room_id);
+}
+
+// What a listing sends about a room, copied out under its shard's lock.
+// The boards are copied after it is released, so a listing with many
+// boards doesn't hold up the rooms being created meanwhile.
+struct ListedRoom {
+    int32_t room_id;
+    int32_t id;
+    int32_t board_size;
+    char name[16];
+    bool can_join;
+};
+
+static void list_room(OutputBuffer *listed, int32_t room_id) {
+    ListedRoom room = {};
+    room.room_id = room_id;
+    room.id = rooms[room_id].id;
+    room.board_size = rooms[room_id].board_size;
+    memcpy(room.name, rooms[room_id].name, 16);
+    room.can_join = (rooms[room_id].player_b == 0);
+    buffer_append(listed, &room, sizeof(room));
+}
+
+static void encode_room(OutputBuffer *out, ListedRoom *room, bool boards) {
+    buffer_append(out, &room->id, sizeof(int32_t));
+    buffer_append(out, room->name, 16);
+    buffer_append(out, &room->can_join, sizeof(room->can_join));
+    if(boards) {
+        Board board;
+        copy_board(room->room_id, &board);
+        // the room may have closed since it was listed and a new one may be
+        // playing in its slot, the listing gets an empty board then
+        if(__atomic_load_n(&rooms[room->room_id].id, __ATOMIC_ACQUIRE) != room->id) {
+            board = {};
+            board.size = room->board_size;
+        }
+        buffer_append(out, &board, sizeof(Board));
+    }
+}
+
+// Picks the shard's rooms the query asks for into listed, in listing order
+// and no more than wanted of them, with the shard's lock held. Returns how
+// many of the shard's rooms the query matches.
+static int32_t list_shard(OutputBuffer *listed, RoomIndex *index, RequestListRooms *query, int32_t wanted) {
+    bool joinable_only = query->flags & LIST_ROOMS_JOINABLE_ONLY;
+    int size = query->board_size;
+
+    char prefix[13] = {};
+    memcpy(prefix, query->name_prefix, 12);
+    size_t prefix_length = strlen(prefix);
+    if(prefix_length == 0) {
+        RoomIds *set = joinable_only ? &index->joinable_rooms : &index->all_rooms;
+        if(size) set = joinable_only ? &index->joinable_rooms_of_size[size] : &index->rooms_of_size[size];
+        for(int32_t i = 0; i < set->count && i < wanted; i++)
+            list_room(listed, set->ids[i]);
+        return set->count;
+    }
+
+    // the names with the prefix follow one another in rooms_by_name
+    RoomIds *by_name = &index->rooms_by_name;
+    int32_t low = 0, high = by_name->count;
+    while(low < high) {
+        int32_t middle = (low + high) / 2;
+        if(strncmp(rooms[by_name->ids[middle]].name, prefix, 16) < 0) low = middle + 1;
+        else high = middle;
+    }
+    int32_t matches = 0;
+    for(int32_t i = low; i < by_name->count; i++) {
+        int32_t room_id = by_name->ids[i];
+        if(strncmp(rooms[room_id].name, prefix, prefix_length) != 0) break;
+        if(size && rooms[room_id].board_size != size) continue;
+        if(joinable_only && rooms[room_id].player_b != 0) continue;
+        if(matches < wanted) list_room(listed, room_id);
+        matches++;
+    }
+    return matches;
+}
+
+static bool listed_before(ListedRoom *a, ListedRoom *b, bool by_name) {
+    if(by_name) {
+        int order = strncmp(a->name, b->name, 16);
+        if(order) return order < 0;
+    }
+    return a->room_id < b->room_id;
+}
+
+void encode_room_list(OutputBuffer *out, RequestListRooms *query) {
+    Response res = {};
+    res.type = RESPONSE_LIST_ROOMS;
+    int size = query->board_size;
+    if(size != 0 && (size < 2 || size > MAX_BOARD_SIZE)) {
+        buffer_append(out, &res, sizeof(res));
+        return;
+    }
+    int32_t offset = query->offset > 0 ? query->offset : 0;
+    int32_t limit = query->limit > 0 ? query->limit : INT32_MAX;
+    // the page is among the first offset + limit rooms of every shard
+    int32_t wanted = limit > INT32_MAX - offset ? INT32_MAX : offset + limit;
+    bool by_name = query->name_prefix[0] != 0;
+
+    static thread_local OutputBuffer listed;
+    listed.size = 0;
+    int32_t ends[ROOM_SHARDS];
+    for(int s = 0; s < ROOM_SHARDS; s++) {
+        pthread_mutex_lock(&room_shards[s].mutex);
+        res.list_rooms.total += list_shard(&listed, &indexes[s], query, wanted);
+        pthread_mutex_unlock(&room_shards[s].mutex);
+        ends[s] = listed.size / (int32_t)sizeof(ListedRoom);
+    }
+    int32_t count = listed.size / (int32_t)sizeof(ListedRoom);
+    res.list_rooms.size = count > offset ? count - offset : 0;
+    if(res.list_rooms.size > limit) res.list_rooms.size = limit;
+    buffer_append(out, &res, sizeof(res));
+
+    // the shards' rooms are merged into listing order, by the id of the
+    // next room of each shard unless they are listed by name
+    bool boards = !(query->flags & LIST_ROOMS_NO_BOARDS);
+    ListedRoom *listed_rooms = (ListedRoom *)listed.data;
+    int32_t next[ROOM_SHARDS];
+    int32_t next_id[ROOM_SHARDS];
+    for(int s = 0; s < ROOM_SHARDS; s++) {
+        next[s] = s ? ends[s-1] : 0;
+        next_id[s] = next[s] < ends[s] ? listed_rooms[next[s]].room_id : INT32_MAX;
+    }
+    int32_t last = res.list_rooms.size ? offset + res.list_rooms.size : 0;
+    for(int32_t n = 0; n < last; n++) {
+        int first = 0;
+        for(int s = 1; s < ROOM_SHARDS; s++)
+            if(next_id[s] < next_id[first]) first = s;
+        if(by_name) {
+            for(int s = 0; s < ROOM_SHARDS; s++) {
+                if(next[s] == ends[s]) continue;
+                if(listed_before(&listed_rooms[next[s]], &listed_rooms[next[first]], true)) first = s;
+            }
+        }
+        if(n >= offset) encode_room(out, &listed_rooms[next[first]], boards);
+        next[first]++;
+        next_id[first] = next[first] < ends[first] ? listed_rooms[next[first]].room_id : INT32_MAX;
+    }
+}
@@ -0,0 +1,919 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server.h"
+
+ServerMode server_mode = SERVER_THREADS;
+int64_t max_queued_bytes = Megabytes(16l);
+ServerStats server_stats;
+SyncDynamicArray<Room> rooms;
+SyncDynamicArray<GameData> games;
+SyncDynamicArray<Client> clients;
+RoomShard room_shards[ROOM_SHARDS];
+
+// client whose requests the calling thread is handling, see client_flush
+static thread_local int corked_client = 0;
+
+// marks a free room slot as taken, see SyncDynamicArray::take_no_lock
+static void take_room(int32_t i) {
+    __atomic_store_n(&rooms[i].slot.generation, rooms[i].slot.generation + 1, __ATOMIC_RELEASE);
+    rooms[i].player_a = -1;
+}
+
+int take_room_slot(int shard_hint) {
+    for(int it = 0; it < ROOM_SHARDS; it++) {
+        RoomShard *shard = &room_shards[(shard_hint + it) % ROOM_SHARDS];
+        // shards without free slots are passed without taking their lock
+        if(!__atomic_load_n(&shard->free_head, __ATOMIC_RELAXED)) continue;
+        pthread_mutex_lock(&shard->mutex);
+        int32_t i = shard->free_head;
+        if(i) {
+            shard->free_head = rooms[i].slot.next_free;
+            take_room(i);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        if(i) return i;
+    }
+
+    // every slot is taken, the new one is in the shard of its index
+    pthread_mutex_lock(&rooms.mutex);
+    int i = rooms.push({});
+    take_room(i);
+    // grows with the rooms under their mutex
+    while(games.size <= i) games.push({});
+    pthread_mutex_unlock(&rooms.mutex);
+    return i;
+}
+
+void release_room_slot(int32_t room_index) {
+    RoomShard *shard = room_shard(room_index);
+    rooms[room_index].slot.next_free = shard->free_head;
+    __atomic_store_n(&shard->free_head, room_index, __ATOMIC_RELAXED);
+}
+
+int take_slot(SyncDynamicArray<Client> &arr) {
+    pthread_mutex_lock(&arr.mutex);
+    int i = arr.take_no_lock();
+    arr[i].connection.desc = -1;
+    pthread_mutex_unlock(&arr.mutex);
+    return i;
+}
+
+// The encoded room list is shared by every client asking for it and only
+// encoded again after a room changed. Clients copy it out holding a
+// reference, the list is freed once the cache replaced it and the last
+// client is done with it.
+struct RoomList {
+    int64_t version;
+    int32_t refs;
+    OutputBuffer encoded;
+};
+
+static int64_t rooms_version = 1;
+static RoomList *room_list;
+static pthread_mutex_t room_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// called after a room was created, joined, played in or closed
+static void rooms_changed() {
+    __atomic_fetch_add(&rooms_version, 1, __ATOMIC_RELEASE);
+}
+
+static void room_list_release(RoomList *list) {
+    if(__atomic_sub_fetch(&list->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(list->encoded.data);
+        free(list);
+    }
+}
+
+static RoomList *room_list_acquire() {
+    pthread_mutex_lock(&room_list_mutex);
+    // changes made while the list is encoded bump the version again, so
+    // they are picked up by the next request
+    int64_t version = __atomic_load_n(&rooms_version, __ATOMIC_ACQUIRE);
+    if(!room_list || room_list->version != version) {
+        RoomList *list = (RoomList *)calloc(1, sizeof(RoomList));
+        list->version = version;
+        // the reference of the cache
+        list->refs = 1;
+        RequestListRooms every_room = {};
+        encode_room_list(&list->encoded, &every_room);
+        if(room_list) room_list_release(room_list);
+        room_list = list;
+    }
+    RoomList *list = room_list;
+    __atomic_add_fetch(&list->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&room_list_mutex);
+    return list;
+}
+
+// frees the room and takes both players out of it, so that neither of them
+// mistakes a new room in the same slot for its own. Called by the room's
+// actor.
+static void close_room(int32_t room_id) {
+    Room *room = &rooms[room_id];
+    int32_t handle = room->id;
+    int board_size = room->board_size;
+    int32_t players[2] = {room->player_a, room->player_b};
+    uint32_t generations[2] = {room->player_a_generation, room->player_b_generation};
+    for(int it = 0; it < 2; it++) {
+        Client *player = &clients[players[it]];
+        if(players[it] <= 0 || player->slot.generation != generations[it]) continue;
+        // a player that left or is in another room already keeps it
+        int32_t expected = handle;
+        __atomic_compare_exchange_n(&player->active_room_id, &expected, 0, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+    RoomShard *shard = room_shard(room_id);
+    pthread_mutex_lock(&shard->mutex);
+    index_room_removed(room_id);
+    Slot slot = room->slot;
+    uint32_t board_version = room->board_version;
+    *room = {};
+    room->slot = slot;
+    // the game stays until the next room in the slot clears it
+    room->board_version = board_version;
+    release_room_slot(room_id);
+    pthread_mutex_unlock(&shard->mutex);
+    rooms_changed();
+    lobby_publish(room_id, handle, LOBBY_ROOM_CLOSED, board_size);
+    Response res = {};
+    res.type = RESPONSE_SPECTATE_END;
+    res.spectate.room_id = handle;
+    spectate_publish(room_id, &res);
+}
+
+int client_open(int desc, int loop) {
+    int client_index = take_slot(clients);
+    Client *client = &clients[client_index];
+    // the slot may be reused, its output buffer is kept
+    pthread_mutex_lock(&client->connection.mutex);
+    client->connection.desc = desc;
+    client->active_room_id = 0;
+    client->loop = loop;
+    client->received.size = 0;
+    client_discard_output(client);
+    client->waiting_for_output = false;
+    client->overflowed = false;
+    client->sending.size = 0;
+    client->sending.sent = 0;
+    client->send_in_flight = false;
+    client->receiving = false;
+    client->closing = false;
+    client->lobby_subscriber = false;
+    client->spectated_room = 0;
+    client->pending_room_id = 0;
+    client->posted_room_id = 0;
+    client->requests_drained = 0;
+    client->input_held = false;
+    client->held_input.size = 0;
+    client->requests_posted = 0;
+    // actors still handling requests of the slot's last client count
+    // them for its generation, see client_request_done
+    __atomic_store_n(&client->requests_handled, (uint64_t)client->slot.generation << 32, __ATOMIC_SEQ_CST);
+    client->waiting_for_rooms = false;
+    pthread_mutex_unlock(&client->connection.mutex);
+    return client_index;
+}
+
+void client_close(int client_index) {
+    Client *client = &clients[client_index];
+    lobby_unsubscribe(client_index);
+    spectate_stop(client_index);
+    // no room's actor lets the client join once it is gone
+    int32_t active_room_id = __atomic_exchange_n(&client->active_room_id, -1, __ATOMIC_ACQ_REL);
+    if(active_room_id > 0) {
+        // tells the other player, after the moves the client made
+        Request leave = {};
+        leave.type = REQUEST_LEAVE_ROOM;
+        room_post(active_room_id, client_index, &leave);
+    }
+
+    if(server_mode == SERVER_URING)
+        uring_close(client);
+    else
+        client_release(client);
+}
+
+void client_release(Client *client) {
+    pthread_mutex_lock(&client->connection.mutex);
+    close(client->connection.desc);
+    count_syscalls(1);
+    client->connection.desc = 0;
+    client_discard_output(client);
+    pthread_mutex_unlock(&client->connection.mutex);
+    pthread_mutex_lock(&clients.mutex);
+    clients.release_no_lock((int)(client - &clients[0]));
+    pthread_mutex_unlock(&clients.mutex);
+}
+
+void buffer_append(OutputBuffer *out, void *data, size_t size) {
+    if(out->size + (int32_t)size > out->capacity) {
+        int32_t capacity = out->capacity ? out->capacity : Kilobytes(4);
+        while(capacity < out->size + (int32_t)size) capacity *= 2;
+        out->data = (uint8_t *)realloc(out->data, capacity);
+        if(!out->data) {
+            printf("Error while growing an output buffer to %d bytes\n", capacity);
+            exit(1);
+        }
+        out->capacity = capacity;
+    }
+    memcpy(out->data + out->size, data, size);
+    out->size += (int32_t)size;
+}
+
+// Moves what wasn't written yet to the front of the buffers, so the buffers
+// of a client that always has a backlog don't keep growing. Unless forced
+// it waits until at least as many bytes were written as are left, each
+// byte is moved at most once that way. A bulk message that was partly
+// written is moved with the part written, see bulk_message_end.
+static void client_compact(Client *client, bool force) {
+    OutputBuffer *out = &client->output;
+    if(out->sent > 0 && (force || out->sent >= out->size - out->sent)) {
+        out->size -= out->sent;
+        memmove(out->data, out->data + out->sent, out->size);
+        out->sent = 0;
+    }
+
+    OutputBuffer *bulk = &client->bulk;
+    int32_t *ends = (int32_t *)client->bulk_ends.data;
+    int32_t count = client->bulk_ends.size / (int32_t)sizeof(int32_t);
+    // messages written completely
+    int32_t done = 0;
+    while(done < count && ends[done] <= bulk->sent) done++;
+    if(done == 0) return;
+    int32_t start = ends[done-1];
+    if(!force && start < bulk->size - start) return;
+    bulk->size -= start;
+    bulk->sent -= start;
+    memmove(bulk->data, bulk->data + start, bulk->size);
+    count -= done;
+    for(int32_t i = 0; i < count; i++) ends[i] = ends[done + i] - start;
+    client->bulk_ends.size = count * (int32_t)sizeof(int32_t);
+}
+
+// whether the message fits under max_queued_bytes, a client it doesn't fit
+// is cut off: its socket is shut down and whoever reads from it closes it
+static bool client_reserve(Client *client, size_t size) {
+    if(client->overflowed) return false;
+    client_compact(client, false);
+    // what the buffers hold, written or not
+    int64_t queued = client->output.size + client->bulk.size + client->sending.size;
+    if(queued + (int64_t)size <= max_queued_bytes) return true;
+    client_compact(client, true);
+    queued = client->output.size + client->bulk.size + client->sending.size;
+    if(queued + (int64_t)size <= max_queued_bytes) return true;
+
+    printf("connection %d has %ld bytes queued, disconnecting it\n",
+           (int)(client - &clients[0]), (long)queued);
+    client->overflowed = true;
+    client_discard_output(client);
+    if(client->connection.desc > 0) {
+        shutdown(client->connection.desc, SHUT_RDWR);
+        count_syscalls(1);
+    }
+    return false;
+}
+
+void client_queue(Client *client, void *data, size_t size) {
+    if(client_reserve(client, size))
+        buffer_append(&client->output, data, size);
+}
+
+void client_queue_bulk(Client *client, void *data, size_t size) {
+    if(client_reserve(client, size))
+        buffer_append(&client->bulk, data, size);
+}
+
+void client_end_bulk(Client *client) {
+    if(client->overflowed) return;
+    int32_t end = client->bulk.size;
+    buffer_append(&client->bulk_ends, &end, sizeof(end));
+}
+
+void client_discard_output(Client *client) {
+    client->output.size = client->output.sent = 0;
+    client->bulk.size = client->bulk.sent = 0;
+    client->bulk_ends.size = 0;
+}
+
+// where the bulk message that was partly written ends, or bulk->sent when
+// no message was started
+static int32_t bulk_message_end(Client *client) {
+    int32_t sent = client->bulk.sent;
+    int32_t *ends = (int32_t *)client->bulk_ends.data;
+    int32_t count = client->bulk_ends.size / (int32_t)sizeof(int32_t);
+    int32_t start = 0;
+    for(int32_t i = 0; i < count; i++) {
+        if(ends[i] > sent) return sent == start ? sent : ends[i];
+        start = ends[i];
+    }
+    return sent;
+}
+
+void client_flush(Client *client) {
+    if(client - &clients[0] == corked_client) return;
+    if(server_mode == SERVER_URING) {
+        uring_flush(client);
+        return;
+    }
+
+    OutputBuffer *out = &client->output;
+    OutputBuffer *bulk = &client->bulk;
+    int desc = client->connection.desc;
+    if(desc <= 0) {
+        // the client is gone, nobody will read this
+        client_discard_output(client);
+        return;
+    }
+
+    while(out->sent < out->size || bulk->sent < bulk->size) {
+        // the rest of a started bulk message, the output and then the
+        // other bulk messages, all in one write
+        int32_t end = bulk_message_end(client);
+        iovec parts[3] = {
+            {bulk->data + bulk->sent, (size_t)(end - bulk->sent)},
+            {out->data + out->sent,   (size_t)(out->size - out->sent)},
+            {bulk->data + end,        (size_t)(bulk->size - end)},
+        };
+        // never blocks, not even on the blocking sockets of the threads
+        msghdr message = {};
+        message.msg_iov = parts;
+        message.msg_iovlen = 3;
+        ssize_t bytes = sendmsg(desc, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+        count_syscalls(1);
+        if(bytes == -1 && errno == EINTR) continue;
+        if(bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            wait_for_output(client);
+            return;
+        }
+        if(bytes == -1) {
+            // whoever reads from the socket notices and closes the client
+            shutdown(desc, SHUT_RDWR);
+            count_syscalls(1);
+            break;
+        }
+
+        int32_t written = (int32_t)bytes;
+        if(written <= end - bulk->sent) {
+            bulk->sent += written;
+            continue;
+        }
+        written -= end - bulk->sent;
+        bulk->sent = end;
+        int32_t from_output = out->size - out->sent;
+        if(from_output > written) from_output = written;
+        out->sent += from_output;
+        bulk->sent += written - from_output;
+    }
+    client_discard_output(client);
+}
+
+void client_send(Client *client, uint32_t generation, void *data, size_t size) {
+    // the client left and its slot may have been taken meanwhile
+    if(__atomic_load_n(&client->slot.generation, __ATOMIC_ACQUIRE) != generation) return;
+    if(server_mode != SERVER_THREADS && post_to_event_loop(client, generation, data, size))
+        return;
+    pthread_mutex_lock(&client->connection.mutex);
+    if(client->slot.generation == generation) {
+        client_queue(client, data, size);
+        client_flush(client);
+    }
+    pthread_mutex_unlock(&client->connection.mutex);
+}
+
+static void send_listing(Client *client, OutputBuffer *listing) {
+    pthread_mutex_lock(&client->connection.mutex);
+    client_queue_bulk(client, listing->data, listing->size);
+    client_end_bulk(client);
+    client_flush(client);
+    pthread_mutex_unlock(&client->connection.mutex);
+}
+
+void send_room_list(Client *client, RequestListRooms *query) {
+    RequestListRooms every_room = {};
+    if(memcmp(query, &every_room, sizeof(every_room)) == 0) {
+        // the lobby refresh every client does, served from the cache
+        RoomList *list = room_list_acquire();
+        send_listing(client, &list->encoded);
+        room_list_release(list);
+        return;
+    }
+
+    // pages and filtered listings are encoded for the client alone
+    static thread_local OutputBuffer listing;
+    listing.size = 0;
+    encode_room_list(&listing, query);
+    send_listing(client, &listing);
+}
+
+// Refused moves are answered with the game they were made in, so the
+// client can set its own game right. A move made outside of any game gets
+// an empty one.
+static void send_illegal_move(Client *client, uint32_t generation, GameData *game) {
+    static const GameData no_game = {};
+    static thread_local OutputBuffer reply;
+    reply.size = 0;
+    Response res = {};
+    res.type = RESPONSE_ILLEGAL_MOVE;
+    buffer_append(&reply, &res, sizeof(res));
+    buffer_append(&reply, game ? game : (GameData *)&no_game, sizeof(GameData));
+    client_send(client, generation, reply.data, reply.size);
+}
+
+// The room's actor plays out the requests clients posted to it. The room
+// the client asked for may have closed since, and another one may have
+// taken its slot, such requests are turned down.
+void handle_room_mail(int32_t room_id, RoomMail *mail) {
+    Room *room = &rooms[room_id];
+    Request *req = &mail->request;
+    int client_index = mail->client_index;
+    uint32_t generation = mail->client_generation;
+    Client *client = &clients[client_index];
+    Response res = {};
+    bool open = room->id != 0 && room->id == mail->room_id;
+    // the client may have left, and a new client may be in its slot.
+    // Nothing is sent to a client that is gone.
+    bool client_gone = __atomic_load_n(&client->slot.generation, __ATOMIC_ACQUIRE) != generation;
+    // the requesting client plays in the room, and isn't a client that
+    // took a player's slot
+    bool is_player_a = open && room->player_a == client_index && room->player_a_generation == generation;
+    bool is_player_b = open && room->player_b == client_index && room->player_b_generation == generation;
+    // the other player of the room and its generation
+    int other_player = is_player_a ? room->player_b : room->player_a;
+    uint32_t other_generation = is_player_a ? room->player_b_generation : room->player_a_generation;
+
+    switch(req->type) {
+        case REQUEST_NEW_ROOM: {
+            // the client took the slot for it, the room is created even
+            // if the client is gone already and left it right away
+            int board_size = req->new_room.board_size;
+            Room new_room = {};
+            new_room.id = mail->room_id;
+            new_room.board_size = board_size;
+            new_room.player_a = client_index;
+            new_room.player_a_generation = generation;
+            memcpy(new_room.name, req->new_room.name, 16);
+
+            // listings may still be copying the board of the room that
+            // had the slot, see copy_board
+            uint32_t version = room->board_version;
+            __atomic_store_n(&room->board_version, version + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            RoomShard *shard = room_shard(room_id);
+            pthread_mutex_lock(&shard->mutex);
+            new_room.slot = room->slot;
+            new_room.board_version = version + 1;
+            *room = new_room;
+            GameData *game = &games[room_id];
+            *game = {};
+            game->board.size = board_size;
+            index_room_added(room_id);
+            pthread_mutex_unlock(&shard->mutex);
+            __atomic_store_n(&room->board_version, version + 2, __ATOMIC_RELEASE);
+            rooms_changed();
+            lobby_publish(room_id, room->id, LOBBY_ROOM_ADDED, board_size);
+            printf("new room id: %d\n", room_id);
+
+            if(client_gone) break;
+            res.type = RESPONSE_NEW_ROOM_RESULT;
+            res.new_room_result.room_id = room->id;
+            send_struct(client, generation, &res);
+        } break;
+
+        case REQUEST_JOIN_ROOM: {
+            if(client_gone) break;
+            res.type = RESPONSE_JOIN_RESULT;
+            res.join_result.success = false;
+            if(!open || room->player_b != 0) {
+                send_struct(client, generation, &res);
+                break;
+            }
+            // the client may have made a room of its own since it asked
+            int32_t expected = 0;
+            if(!__atomic_compare_exchange_n(&client->active_room_id, &expected, room->id, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                send_struct(client, generation, &res);
+                break;
+            }
+            RoomShard *shard = room_shard(room_id);
+            pthread_mutex_lock(&shard->mutex);
+            room->player_b = client_index;
+            room->player_b_generation = generation;
+            index_room_joined(room_id);
+            pthread_mutex_unlock(&shard->mutex);
+            rooms_changed();
+            lobby_publish(room_id, room->id, LOBBY_ROOM_FULL, room->board_size);
+
+            res.join_result.success = true;
+            send_struct(client, generation, &res);
+
+            Response res2 = {};
+            res2.type = RESPONSE_PLAYER_JOINED;
+            send_struct(&clients[room->player_a], room->player_a_generation, &res2);
+            puts("join success");
+        } break;
+
+        case REQUEST_LEAVE_ROOM: {
+            // also posted for players that disconnected, they are gone
+            if(!is_player_a && !is_player_b) break;
+            // closed first, listings the other player asks for once it
+            // got the exit don't have the room anymore
+            close_room(room_id);
+            if(other_player > 0) {
+                Response res = {};
+                res.type = RESPONSE_EXIT;
+                send_struct(&clients[other_player], other_generation, &res);
+            }
+        } break;
+
+        case REQUEST_MAKE_MOVE: {
+            // a player that is gone has its leave posted next
+            if(client_gone) break;
+            // the other player may have closed the room meanwhile, or the
+            // client's join was turned down
+            if(!is_player_a && !is_player_b) {
+                send_illegal_move(client, generation, NULL);
+                break;
+            }
+            v2_8 move = req->make_move.move;
+            int x = (int)move.x, y = (int)move.y;
+            GameData *game = &games[room_id];
+            // listings copy the board meanwhile, see copy_board
+            uint32_t version = room->board_version;
+            __atomic_store_n(&room->board_version, version + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            bool result = game->maybe_make_move(x, y);
+            __atomic_store_n(&room->board_version, version + 2, __ATOMIC_RELEASE);
+            if(!result) {
+                send_illegal_move(client, generation, game);
+                // nothing happened the opponent should see
+                break;
+            }
+
+            printf("sending move to player %d\n", other_player);
+            res.type = RESPONSE_NEW_MOVE;
+            res.new_move.room_id = room->id;
+            res.new_move.move.x = x;
+            res.new_move.move.y = y;
+            res.new_move.move_number = game->log.move_count - 1;
+
+            spectate_publish(room_id, &res);
+            if(other_player > 0) send_struct(&clients[other_player], other_generation, &res);
+            rooms_changed();
+            lobby_publish(room_id, room->id, LOBBY_ROOM_BOARD, game->board.size);
+
+            auto w = game->winner();
+            if(w) {
+                printf("game %d finished\n", room_id);
+                close_room(room_id);
+            }
+        } break;
+
+        case REQUEST_SPECTATE_ROOM: {
+            if(client_gone) break;
+            spectate_room(client_index, generation, open ? room_id : 0, mail->ticket);
+        } break;
+
+        default: break;
+    }
+}
+
+bool handle_request(int client_index, Request *req, int32_t room_id) {
+    Client *client = &clients[client_index];
+    Response res = {};
+    // set by the actors of the rooms the client joins and leaves
+    int32_t active_room_id = __atomic_load_n(&client->active_room_id, __ATOMIC_ACQUIRE);
+
+    switch(req->type) {
+        case REQUEST_NEW_ROOM: {
+            printf("requested new room by connection %d\n", client_index);
+            int board_size = req->new_room.board_size;
+            printf("requested board size %d\n", board_size);
+            res.type = RESPONSE_NEW_ROOM_RESULT;
+            if(active_room_id != 0 || board_size < 2 || board_size > 19) {
+                res.new_room_result.room_id = 0;
+                send_struct(client, client->slot.generation, &res);
+                break;
+            }
+
+            // a client's rooms keep to one shard while it has free slots
+            int32_t new_room_id = take_room_slot(client_index);
+            int32_t handle = room_handle(new_room_id);
+            // a join posted before may have gone through meanwhile
+            int32_t expected = 0;
+            if(!__atomic_compare_exchange_n(&client->active_room_id, &expected, handle, false,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                RoomShard *shard = room_shard(new_room_id);
+                pthread_mutex_lock(&shard->mutex);
+                rooms[new_room_id].player_a = 0;
+                release_room_slot(new_room_id);
+                pthread_mutex_unlock(&shard->mutex);
+                res.new_room_result.room_id = 0;
+                send_struct(client, client->slot.generation, &res);
+                break;
+            }
+            client->pending_room_id = 0;
+            room_post(handle, client_index, req);
+        } break;
+
+        case REQUEST_JOIN_ROOM: {
+            res.type = RESPONSE_JOIN_RESULT;
+            printf("reqested join id %d by connection %d\n", req->join_room.room_id, client_index);
+            printf("active room %d\n", active_room_id);
+
+            res.join_result.success = false;
+            if(room_id == 0 || room_index(room_id) == 0) {
+                send_struct(client, client->slot.generation, &res);
+                break;
+            }
+            client->pending_room_id = room_id;
+            room_post(room_id, client_index, req);
+        } break;
+
+        case REQUEST_LEAVE_ROOM: {
+            puts("got request leave room");
+            // the room's actor clears it again if it lets the client join
+            // before it gets to the leave
+            __atomic_store_n(&client->active_room_id, 0, __ATOMIC_RELEASE);
+            client->pending_room_id = 0;
+            if(room_id > 0) room_post(room_id, client_index, req);
+        } break;
+
+        case REQUEST_MAKE_MOVE: {
+            v2_8 move = req->make_move.move;
+            printf("reqested make move (%d, %d) by connection %d\n", (int)move.x, (int)move.y, client_index);
+            if(server_stats.enabled)
+                __atomic_fetch_add(&server_stats.moves, 1, __ATOMIC_RELAXED);
+            if(room_id > 0) room_post(room_id, client_index, req);
+            else            send_illegal_move(client, client->slot.generation, NULL);
+        } break;
+
+        case REQUEST_LIST_ROOMS: {
+            printf("got request list rooms from %d\n", client_index);
+            send_room_list(client, &req->list_rooms);
+        } break;
+
+        case REQUEST_SUBSCRIBE_LOBBY: {
+            printf("got request subscribe lobby from %d\n", client_index);
+            lobby_subscribe(client_index, &req->list_rooms);
+        } break;
+
+        case REQUEST_UNSUBSCRIBE_LOBBY: {
+            printf("got request unsubscribe lobby from %d\n", client_index);
+            lobby_unsubscribe(client_index);
+        } break;
+
+        case REQUEST_SPECTATE_ROOM: {
+            printf("got request spectate room %d from %d\n", req->join_room.room_id, client_index);
+            // the room the client watched is let go right away, the new
+            // one adds it when its actor gets to the request
+            uint32_t ticket = spectate_stop(client_index);
+            if(room_index(room_id) == 0) {
+                res.type = RESPONSE_SPECTATE_SNAPSHOT;
+                send_struct(client, client->slot.generation, &res);
+                break;
+            }
+            room_post(room_id, client_index, req, ticket);
+        } break;
+
+        case REQUEST_NONE: {
+            printf("got request none from %d\n", client_index);
+            return false;
+        } break;
+        case REQUEST_EXIT: {
+            printf("got reqest exit from %d\n", client_index);
+            return false;
+        } break;
+
+        default: {
+            printf("received unrecognized request type %d\n", (int)req->type);
+        }
+    }
+    return true;
+}
+
+static void cork(int client_index) {
+    corked_client = client_index;
+}
+
+// writes the replies queued while the client was corked
+static void uncork(int client_index) {
+    corked_client = 0;
+    Client *client = &clients[client_index];
+    pthread_mutex_lock(&client->connection.mutex);
+    client_flush(client);
+    pthread_mutex_unlock(&client->connection.mutex);
+}
+
+// The room a request is posted to, 0 for the requests the connection
+// answers itself. Moves and leaves go to the room the client asked to join
+// until its actor let it in.
+static int32_t request_room(Client *client, Request *req) {
+    int32_t active_room_id = __atomic_load_n(&client->active_room_id, __ATOMIC_ACQUIRE);
+    switch(req->type) {
+        case REQUEST_JOIN_ROOM:
+            return active_room_id == 0 ? req->join_room.room_id : 0;
+        case REQUEST_LEAVE_ROOM:
+        case REQUEST_MAKE_MOVE:
+            return active_room_id > 0 ? active_room_id : client->pending_room_id;
+        case REQUEST_SPECTATE_ROOM:
+            return req->join_room.room_id;
+        default:
+            return 0;
+    }
+}
+
+// the actors handled every request the client posted
+static bool requests_done(Client *client) {
+    uint64_t handled = __atomic_load_n(&client->requests_handled, __ATOMIC_SEQ_CST);
+    return (uint32_t)handled == __atomic_load_n(&client->requests_posted, __ATOMIC_SEQ_CST);
+}
+
+// Whether replies made now come after the actors' replies to the requests
+// posted before. With event loops the actors' replies are posted to the
+// loop, they are only known to be queued once the loop resumed the client.
+static bool caught_up(Client *client) {
+    if(server_mode == SERVER_THREADS) return requests_done(client);
+    return client->requests_posted == client->requests_drained;
+}
+
+// Returns whether the client may go on with its requests. Threads block
+// until the actors are done, event loops hold the client's requests back
+// until client_resume and go on with the other clients.
+static bool wait_for_rooms(Client *client) {
+    if(server_mode == SERVER_THREADS) {
+        pthread_mutex_lock(&client->connection.mutex);
+        __atomic_store_n(&client->waiting_for_rooms, true, __ATOMIC_SEQ_CST);
+        while(!requests_done(client))
+            pthread_cond_wait(&client->rooms_done, &client->connection.mutex);
+        __atomic_store_n(&client->waiting_for_rooms, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&client->connection.mutex);
+        return true;
+    }
+    client->input_held = true;
+    __atomic_store_n(&client->waiting_for_rooms, true, __ATOMIC_SEQ_CST);
+    // the actors may be done already, their replies are posted to the loop
+    // then and the resume goes after them. Whoever clears the flag posts it.
+    if(requests_done(client) && __atomic_exchange_n(&client->waiting_for_rooms, false, __ATOMIC_SEQ_CST))
+        post_resume(client, client->slot.generation);
+    return false;
+}
+
+void client_request_done(int client_index, uint32_t generation) {
+    Client *client = &clients[client_index];
+    uint64_t handled = __atomic_load_n(&client->requests_handled, __ATOMIC_SEQ_CST);
+    do {
+        // the client left, the count is the next client's in the slot
+        if((uint32_t)(handled >> 32) != generation) return;
+    } while(!__atomic_compare_exchange_n(&client->requests_handled, &handled, handled + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+    if(!__atomic_load_n(&client->waiting_for_rooms, __ATOMIC_SEQ_CST)) return;
+    if(server_mode == SERVER_THREADS) {
+        pthread_mutex_lock(&client->connection.mutex);
+        pthread_cond_broadcast(&client->rooms_done);
+        pthread_mutex_unlock(&client->connection.mutex);
+    } else if(requests_done(client) && __atomic_exchange_n(&client->waiting_for_rooms, false, __ATOMIC_SEQ_CST)) {
+        post_resume(client, generation);
+    }
+}
+
+// handles every complete request in data, returns the number of bytes they
+// took or -1 once the client should be disconnected. Stops early once the
+// client's requests are held, see wait_for_rooms.
+static int32_t handle_requests(int client_index, uint8_t *data, int32_t size) {
+    Client *client = &clients[client_index];
+    int32_t used = 0;
+    for(; size - used >= (int32_t)sizeof(Request); used += sizeof(Request)) {
+        Request *req = (Request *)(data + used);
+        Request copy;
+        if((uintptr_t)req % alignof(Request)) {
+            // kernel buffers may have the requests at any offset
+            memcpy(&copy, req, sizeof(Request));
+            req = &copy;
+        }
+        // requests for the room posted to last are handled in order by its
+        // actor, everything else waits for the replies of the ones before
+        int32_t room_id = request_room(client, req);
+        if((room_id == 0 || room_id != client->posted_room_id) && !caught_up(client) &&
+           !wait_for_rooms(client))
+            break;
+        if(!handle_request(client_index, req, room_id)) return -1;
+    }
+    return used;
+}
+
+// handle_requests, but the requests left once the client's requests are
+// held go to held_input, and so does everything read until it is resumed.
+// Returns the bytes used like handle_requests.
+static int32_t take_requests(int client_index, uint8_t *data, int32_t size) {
+    Client *client = &clients[client_index];
+    int32_t used = client->input_held ? 0 : handle_requests(client_index, data, size);
+    if(used < 0 || !client->input_held) return used;
+    OutputBuffer *held = &client->held_input;
+    if(held->size + size - used > max_queued_bytes) {
+        printf("client %d sent %d bytes of requests while it waited, disconnecting\n",
+               client_index, held->size + size - used);
+        return -1;
+    }
+    buffer_append(held, data + used, size - used);
+    return size;
+}
+
+void client_resume(int client_index, uint32_t generation) {
+    Client *client = &clients[client_index];
+    if(client->slot.generation != generation || client->connection.desc <= 0 ||
+       client->closing || !client->input_held)
+        return;
+    // the actors' replies to everything posted so far are queued
+    client->input_held = false;
+    client->requests_drained = client->requests_posted;
+    OutputBuffer *held = &client->held_input;
+    cork(client_index);
+    int32_t used = handle_requests(client_index, held->data, held->size);
+    uncork(client_index);
+    if(used < 0) {
+        client_close(client_index);
+        return;
+    }
+    held->size -= used;
+    memmove(held->data, held->data + used, held->size);
+    if(client->input_held) return;
+    // a partial request, completed by what is read next
+    RecvBuffer *in = &client->received;
+    memcpy(in->data, held->data, held->size);
+    in->size = held->size;
+    held->size = 0;
+}
+
+ssize_t client_receive(int client_index, bool *more) {
+    RecvBuffer *in = &clients[client_index].received;
+    int32_t space = RECV_BUFFER_SIZE - in->size;
+    ssize_t bytes = read(clients[client_index].connection.desc, in->data + in->size, space);
+    count_syscalls(1);
+    *more = bytes == space;
+    if(bytes <= 0) return bytes;
+
+    in->size += (int32_t)bytes;
+    cork(client_index);
+    int32_t used = take_requests(client_index, in->data, in->size);
+    uncork(client_index);
+    if(used < 0) return 0;
+    in->size -= used;
+    memmove(in->data, in->data + used, in->size);
+    return bytes;
+}
+
+// handle_received without the cork
+static bool handle_buffer(int client_index, uint8_t *data, int32_t size) {
+    RecvBuffer *in = &clients[client_index].received;
+    if(in->size > 0) {
+        // complete the request left over from the last buffer first
+        int32_t bytes = (int32_t)sizeof(Request) - in->size;
+        if(bytes > size) bytes = size;
+        memcpy(in->data + in->size, data, bytes);
+        in->size += bytes;
+        data += bytes;
+        size -= bytes;
+        if(in->size < (int32_t)sizeof(Request)) return true;
+        in->size = 0;
+        if(take_requests(client_index, in->data, sizeof(Request)) < 0) return false;
+    }
+
+    int32_t used = take_requests(client_index, data, size);
+    if(used < 0) return false;
+    in->size = size - used;
+    memcpy(in->data, data + used, in->size);
+    return true;
+}
+
+bool handle_received(int client_index, uint8_t *data, int32_t size) {
+    cork(client_index);
+    bool open = handle_buffer(client_index, data, size);
+    uncork(client_index);
+    return open;
+}
+
+static void *print_stats(void *) {
+    const char *mode_names[] = {"threads", "epoll", "io_uring"};
+    int64_t syscalls = 0, moves = 0;
+    while(1) {
+        sleep(1);
+        int64_t new_syscalls = __atomic_load_n(&server_stats.syscalls, __ATOMIC_RELAXED);
+        int64_t new_moves = __atomic_load_n(&server_stats.moves, __ATOMIC_RELAXED);
+        int64_t s = new_syscalls - syscalls, m = new_moves - moves;
+        syscalls = new_syscalls;
+        moves = new_moves;
+        if(m == 0) continue;
+        fprintf(stderr, "stats %s: %ld moves/s, %ld syscalls/s, %.2f syscalls/move\n",
+                mode_names[server_mode], (long)m, (long)s, (double)s / m);
+    }
+    return 0;
+}
+
+void start_stats_thread() {
+    server_stats.enabled = true;
+    pthread_t thread;
+    pthread_create(&thread, NULL, print_stats, NULL);
+    pthread_detach(thread);
+}
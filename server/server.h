@@ -0,0 +1,530 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "game_logic.h"
+#include "protocol.h"
+
+#define Kilobytes(x) (1024*(x))
+#define Megabytes(x) (1024*Kilobytes(x))
+#define Gigabytes(x) (1024*Megabytes(x))
+
+#define SERVER_PORT 1234
+#define QUEUE_SIZE 5
+
+// Rooms and clients are kept in slots that are taken and released with
+// the array's mutex held. Released slots are linked into a free list
+// through their Slot, so neither looks at the other slots. Taking a slot
+// bumps its generation, an index saved with the generation it had tells
+// whether the slot was reused since.
+struct Slot {
+    uint32_t generation;
+    // the next released slot, slot 0 is never released and ends the list
+    int32_t next_free;
+};
+
+template <class T>
+struct SyncDynamicArray {
+    int32_t size;
+    int32_t allocated;
+    T *data;
+    pthread_mutex_t mutex;
+    int32_t free_head;
+
+    SyncDynamicArray() {
+        size = 0;
+        allocated = 0;
+        free_head = 0;
+        data = (T *)mmap(0, Gigabytes(2l), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(data == (T *)-1) {
+            printf("%s\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    T& operator[](uint64_t i) { return data[i]; }
+    T& operator[](int i)      { return data[i]; }
+
+
+    int push(T el) {
+        while(allocated <= (size+1)*(int32_t)sizeof(T)) {
+            allocated += Kilobytes(4);
+            int err = mprotect(data, allocated, PROT_READ | PROT_WRITE);
+            if(err) {
+                printf("%s\n", strerror(errno));
+                assert(false);
+            }
+        }
+        data[size] = el;
+        size += 1;
+        return (int)size-1;
+    }
+
+    int push_lock(T el) {
+        pthread_mutex_lock(&mutex);
+        int index = push(el);
+        pthread_mutex_unlock(&mutex);
+        return index;
+    }
+
+    // T needs a Slot named slot, it has to be kept when T is cleared
+    int take_no_lock() {
+        int index = free_head;
+        if(index) free_head = data[index].slot.next_free;
+        else      index = push({});
+        // read without the mutex by senders checking for a new client
+        __atomic_store_n(&data[index].slot.generation, data[index].slot.generation + 1, __ATOMIC_RELEASE);
+        return index;
+    }
+
+    void release_no_lock(int index) {
+        data[index].slot.next_free = free_head;
+        free_head = index;
+    }
+
+    T pop_no_lock() {
+        T res = data[--size];
+        memset((void *)&data[size], 0, sizeof(T));
+
+        if(allocated >= size*sizeof(T) + Kilobytes(8)) {
+            int err = mprotect(data, allocated, PROT_NONE);
+            if(err) {
+                printf("Error in mprotect: %s\n", strerror(errno));
+                assert(false);
+            }
+            allocated -= Kilobytes(4);
+            err = mprotect(data, allocated, PROT_READ | PROT_WRITE);
+            if(err) {
+                printf("Error in mprotect: %s\n", strerror(errno));
+                assert(false);
+            }
+        }
+
+        return res;
+    }
+
+    T pop() {
+        pthread_mutex_lock(&mutex);
+        T res = pop_no_lock();
+        pthread_mutex_unlock(&mutex);
+        return res;
+    }
+};
+
+
+// What listings, joins and lobby events look at, a few bytes per room so
+// that going through the rooms stays in cache. The game itself, with its
+// move log, is kept apart in games under the same index. Only the room's
+// actor changes a room that was created, under its shard's lock for
+// everything listings read.
+struct Room {
+    Slot slot;
+    // the id clients know the room by, 0 while the slot is free. Requests
+    // for an older room in the slot don't match it.
+    int32_t id;
+    int32_t player_a;
+    int32_t player_b;
+    // slot generations of the players, a client that took a player's
+    // slot after it left isn't the player
+    uint32_t player_a_generation;
+    uint32_t player_b_generation;
+    int32_t board_size;
+    // odd while the actor changes the board, see copy_board
+    uint32_t board_version;
+    char name[16];
+};
+
+// How connections are served, picked on the command line. With threads
+// every client gets a thread blocking on its socket, with epoll and
+// io_uring a few event loop threads serve all of them. The io_uring loops
+// keep accepts, receives and sends in flight in the kernel instead of
+// waiting for sockets to become ready.
+enum ServerMode {
+    SERVER_THREADS,
+    SERVER_EPOLL,
+    SERVER_URING,
+};
+
+// bytes waiting to go out, the first `sent` of them already did
+struct OutputBuffer {
+    uint8_t *data;
+    int32_t size;
+    int32_t sent;
+    int32_t capacity;
+};
+
+// Bytes read from a client's socket. As many as are available are read at
+// once and every complete request is handled straight from the buffer, a
+// request that is still missing bytes is moved to the front.
+#define RECV_BUFFER_SIZE Kilobytes(4)
+
+struct RecvBuffer {
+    alignas(Request) uint8_t data[RECV_BUFFER_SIZE];
+    int32_t size;
+};
+
+struct Client {
+    Slot slot;
+    Connection connection;
+    // id of the room the client plays in, set by the room's actor once it
+    // joined and cleared when the room closes. -1 once the client left.
+    int32_t active_room_id;
+    // event loop that accepted the client, the only one to read and
+    // write its socket
+    int32_t loop;
+
+    // only touched by the thread reading from the socket
+    RecvBuffer received;
+    // room the client asked to join, its moves and leaves go there until
+    // the room's actor let it in or turned it away
+    int32_t pending_room_id;
+    // room the client's last request was posted to. Its requests for other
+    // rooms and the ones the connection answers itself wait for the actors
+    // to handle the ones posted before, so replies keep the request order.
+    int32_t posted_room_id;
+    // event loops: requests posted when the loop last caught up with the
+    // actors' replies, and the requests read while the client waits for
+    // them, see client_resume
+    uint32_t requests_drained;
+    bool input_held;
+    OutputBuffer held_input;
+
+    // requests posted to room actors, and handled by them with the slot
+    // generation above the count, see client_request_done
+    uint32_t requests_posted;
+    uint64_t requests_handled;
+    // the connection waits for the actors, threads on rooms_done with
+    // connection.mutex
+    bool waiting_for_rooms;
+    pthread_cond_t rooms_done;
+
+    // guarded by connection.mutex. Replies and game events go to output,
+    // room listings to bulk. Output goes out first, but a bulk message that
+    // was partly written is finished before it, bulk_ends holds the end of
+    // every bulk message as int32_t.
+    OutputBuffer output;
+    OutputBuffer bulk;
+    OutputBuffer bulk_ends;
+    // the event loop or the flusher is waiting for the socket to become
+    // writable
+    bool waiting_for_output;
+    // the client stopped reading and was cut off, nothing more is queued
+    bool overflowed;
+
+    // io_uring loops: bytes the kernel is sending, new responses are
+    // queued in output meanwhile, and which operations are in flight.
+    // The slot is freed only after both of them completed.
+    OutputBuffer sending;
+    bool send_in_flight;
+    bool receiving;
+    bool closing;
+
+    // subscribed to lobby events and where in its loop's list of
+    // subscribers, guarded by that list's mutex
+    bool lobby_subscriber;
+    int32_t lobby_slot;
+    // room the client watches, where in its list of spectators and the
+    // spectate ticket it was added for, guarded by that list's mutex
+    int32_t spectated_room;
+    int32_t spectator_slot;
+    uint32_t spectator_ticket;
+    // counts the client's spectate requests, a room's actor only adds
+    // the client for the latest one. Guarded by connection.mutex.
+    uint32_t spectate_ticket;
+};
+
+// Counted for the --stats benchmark mode: the system calls made to serve
+// clients, logging aside, and the moves made.
+struct ServerStats {
+    bool enabled;
+    int64_t syscalls;
+    int64_t moves;
+};
+
+extern ServerStats server_stats;
+
+inline void count_syscalls(int count) {
+    if(server_stats.enabled)
+        __atomic_fetch_add(&server_stats.syscalls, count, __ATOMIC_RELAXED);
+}
+
+extern ServerMode server_mode;
+// A client with more output queued than this doesn't read what it is sent.
+// Writes never block, so it would only hold on to more and more memory,
+// it is disconnected instead.
+extern int64_t max_queued_bytes;
+// first valid room index is 1
+extern SyncDynamicArray<Room> rooms;
+// game of the room with the same index, made by its players' moves. Only
+// listings with boards and board events read it from other clients.
+extern SyncDynamicArray<GameData> games;
+// first valid client index is 1
+extern SyncDynamicArray<Client> clients;
+
+// O(1), the slot is marked as taken until it is filled
+int take_slot(SyncDynamicArray<Client> &arr);
+
+// The room table is split into shards by room index. Each shard has a lock
+// of its own for its free slots, the rooms' players and names and its part
+// of the listing indexes, so rooms of different shards are created, joined
+// and closed without waiting for each other. rooms.mutex only grows the
+// table.
+#define ROOM_SHARDS 16
+
+struct alignas(64) RoomShard {
+    pthread_mutex_t mutex;
+    // released slots of the shard, linked through their Slot
+    int32_t free_head;
+};
+
+extern RoomShard room_shards[ROOM_SHARDS];
+
+inline RoomShard *room_shard(int32_t room_index) {
+    return &room_shards[room_index % ROOM_SHARDS];
+}
+
+// takes a free room slot, from the shard picked by the hint if it has one
+int take_room_slot(int shard_hint);
+// puts the slot back on its shard's free list, with the shard's lock held
+void release_room_slot(int32_t room_index);
+
+// Room ids given to clients carry the generation of the room's slot above
+// the index, an id from an old listing doesn't name the room that took
+// the slot later.
+#define ROOM_INDEX_BITS 20
+static_assert(Gigabytes(2l) / sizeof(GameData) < (1 << ROOM_INDEX_BITS), "room indices don't fit");
+
+inline int32_t room_handle(int32_t room_index) {
+    uint32_t generation = rooms[room_index].slot.generation & ((1u << (31 - ROOM_INDEX_BITS)) - 1);
+    return (int32_t)(generation << ROOM_INDEX_BITS | (uint32_t)room_index);
+}
+
+// index of the slot of the room with the id, 0 if no room can have it.
+// Whether the room is still in the slot only its actor knows, see Room::id.
+inline int32_t room_index(int32_t handle) {
+    int32_t index = handle & ((1 << ROOM_INDEX_BITS) - 1);
+    if(handle <= 0 || index == 0 || index >= __atomic_load_n(&rooms.size, __ATOMIC_ACQUIRE)) return 0;
+    return index;
+}
+
+// Listings copy boards while the room's actor plays on them, without
+// waiting for it. A copy made while the version was odd or changed is
+// made again.
+inline void copy_board(int32_t room_index, Board *to) {
+    uint32_t *version = &rooms[room_index].board_version;
+    while(1) {
+        uint32_t before = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+        if(before & 1) continue;
+        memcpy(to, &games[room_index].board, sizeof(Board));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(version, __ATOMIC_RELAXED) == before) return;
+    }
+}
+
+// epoll data of a client, the generation tells apart events for a client
+// that left from events for the next client in the slot
+inline uint64_t client_event_data(int client_index) {
+    return (uint64_t)clients[client_index].slot.generation << 32 | (uint32_t)client_index;
+}
+
+// takes a free client slot for the socket and returns its index
+int client_open(int desc, int loop);
+// tells the other player the client left and frees its slot
+void client_close(int client_index);
+// closes the socket and frees the slot of a client that left
+void client_release(Client *client);
+
+void buffer_append(OutputBuffer *buffer, void *data, size_t size);
+
+// Responses are queued on the client and written out by client_flush.
+// Messages that have to arrive one right after another are queued and
+// flushed with connection.mutex held, client_send does it for one message.
+// Only client_send may be used for clients of another event loop.
+// While a thread handles a batch of requests read from a client, the client
+// is corked: client_flush leaves the replies queued and they are written
+// together once the batch is done. Flushes for other clients, e.g. sending
+// them a move, are never held back.
+#define queue_struct(client, data) client_queue(client, (void *)data, sizeof(*data))
+void client_queue(Client *client, void *data, size_t size);
+void client_queue_bulk(Client *client, void *data, size_t size);
+// ends the bulk message queued so far, output may go out before the next one
+void client_end_bulk(Client *client);
+void client_flush(Client *client);
+// drops everything queued for a client that left
+void client_discard_output(Client *client);
+
+// The message is for the client of the slot generation given. It is dropped
+// once that client left, a new client in the slot never gets it.
+#define send_struct(client, generation, data) client_send(client, generation, (void *)data, sizeof(*data))
+void client_send(Client *client, uint32_t generation, void *data, size_t size);
+
+// returns false once the client should be disconnected, room_id is the
+// room the request goes to, see request_room in server.cpp
+bool handle_request(int client_index, Request *req, int32_t room_id);
+// reads from the client's socket once and handles every request completed.
+// Returns what read() did, or 0 once the client should be disconnected.
+// more is set when the read filled the buffer and the socket may hold more.
+ssize_t client_receive(int client_index, bool *more);
+// handles the requests in bytes the kernel read into a buffer of its own,
+// returns false like handle_request
+bool handle_received(int client_index, uint8_t *data, int32_t size);
+// called by a room's actor once it handled a request of the client
+void client_request_done(int client_index, uint32_t generation);
+// handles the requests an event loop held back while the client waited
+// for its room actors, posted to the loop after the actors' replies
+void client_resume(int client_index, uint32_t generation);
+
+// prints moves and syscalls per second and per move
+void start_stats_thread();
+
+// main.cpp
+int open_server_socket(bool reuse_port);
+
+// room_index.cpp, the rooms are indexed by size, whether they can be
+// joined and name for listings. Called with the room's shard lock held.
+void index_room_added(int32_t room_id);
+void index_room_joined(int32_t room_id);
+// before the room is cleared
+void index_room_removed(int32_t room_id);
+// appends RESPONSE_LIST_ROOMS and the rooms the query asks for. The rooms
+// are picked one shard at a time so the count always matches the rooms
+// sent. Each shard's lock is held for its pass only, the boards are copied
+// without any.
+void encode_room_list(OutputBuffer *out, RequestListRooms *query);
+
+// server.cpp, queues the listing the query asks for and flushes it
+void send_room_list(Client *client, RequestListRooms *query);
+
+// lobby.cpp
+
+// A message encoded once and written to many clients, freed with the last
+// reference.
+struct SharedMessage {
+    int32_t refs;
+    OutputBuffer encoded;
+};
+
+void shared_message_release(SharedMessage *message);
+
+// Subscribed clients get a RESPONSE_LOBBY_EVENT whenever a room is added,
+// filled, played in or closed instead of asking for the listing again.
+// Every event is encoded once and each event loop hands it to its own
+// subscribers.
+void lobby_subscribe(int client_index, RequestListRooms *query);
+void lobby_unsubscribe(int client_index);
+// called by the room's actor after the change, with no mutex held
+void lobby_publish(int32_t room_id, int32_t handle, LobbyEventType event, int board_size);
+// queues the event for the loop's subscribers, or flushes them
+void lobby_deliver(int loop, SharedMessage *message, bool flush);
+
+// spectate.cpp
+
+// Spectators get a snapshot of the moves made in a room and then every
+// move until the game ends. Each event is encoded once, spectators of
+// other event loops get it through one mailbox message per loop.
+// called by the room's actor, sends an empty snapshot when the room is
+// gone or the client asked to watch another room since
+void spectate_room(int client_index, uint32_t generation, int32_t room_index, uint32_t ticket);
+// also drops the client's pending spectate request, returns its new ticket
+uint32_t spectate_stop(int client_index);
+// sends a RESPONSE_NEW_MOVE or RESPONSE_SPECTATE_END to the room's
+// spectators, the end lets all of them go. Called by the room's actor.
+void spectate_publish(int32_t room_id, Response *event);
+// A spectator an event was copied out for. The event is dropped if the
+// client left or asked to watch something else before it got it.
+struct PostedSpectator {
+    int32_t client_index;
+    uint32_t generation;
+    uint32_t ticket;
+};
+
+// queues the event for the spectators posted with it as PostedSpectator,
+// or flushes them
+void spectate_deliver(int loop, SharedMessage *message, uint8_t *spectators,
+                      int32_t count, bool flush);
+
+// room_actor.cpp
+
+// Rooms are actors. Requests that create, join, leave, play in or watch a
+// room are posted to its mailbox and a fixed pool of workers hands them to
+// handle_room_mail in the order the room got them. A room with mail is
+// given to one worker at a time, so its game is only ever touched by one
+// thread and the moves take no lock.
+struct RoomMail {
+    int32_t client_index;
+    uint32_t client_generation;
+    // the id the client knows the room by, the room's index for new rooms
+    int32_t room_id;
+    // the client's spectate ticket for REQUEST_SPECTATE_ROOM
+    uint32_t ticket;
+    Request request;
+};
+
+void room_post(int32_t room_id, int client_index, Request *req, uint32_t ticket = 0);
+void start_room_workers(int count);
+
+// server.cpp, called by the room's actor
+void handle_room_mail(int32_t room_index, RoomMail *mail);
+
+// event_loop.cpp
+
+// Each event loop runs on its own thread pinned to a core, accepts on its
+// own SO_REUSEPORT listening socket and keeps the clients it accepted.
+// Responses for a client of another loop are posted to that loop's mailbox
+// and the loop is woken up through an eventfd to write them.
+struct EventLoop {
+    int index;
+    pthread_t thread;
+    int epoll_descriptor;
+    int listening_descriptor;
+    int wakeup_descriptor;
+    struct Uring *ring;
+
+    // messages from other loops, each one is the client index, its slot
+    // generation and the message size as int32_t followed by the message
+    pthread_mutex_t mailbox_mutex;
+    OutputBuffer mailbox;
+    // the buffer the mailbox is swapped with while it is being delivered
+    OutputBuffer delivering;
+};
+
+#define MAX_EVENT_LOOPS 64
+extern EventLoop loops[MAX_EVENT_LOOPS];
+
+void run_event_loops(int count);
+// With threads the client threads only block on reads, output the sockets
+// can't take right away is written by a flusher thread once they can.
+void start_flusher();
+// called by client_flush when the socket can't take all queued bytes
+void wait_for_output(Client *client);
+// hands the message to the loop of a client that belongs to another
+// event loop, returns false for clients of the calling thread's loop
+bool post_to_event_loop(Client *client, uint32_t generation, void *data, size_t size);
+// hands a lobby event to the loop's subscribers, takes a reference to it.
+// Returns false when the calling thread's loop has no mail waiting, the
+// event can be delivered right away then.
+bool post_lobby_event(int loop, SharedMessage *message);
+// posts a spectator event, the message pointer followed by the spectators
+// it goes to, the caller takes a reference for it. Returns false like
+// post_lobby_event.
+bool post_spectator_event(int loop, void *mail, size_t size);
+// has the client's loop call client_resume after the mail posted so far
+void post_resume(Client *client, uint32_t generation);
+// queues and flushes the messages posted to the loop, the eventfd has to
+// be read by the caller
+void deliver_mail(EventLoop *loop);
+
+// uring.cpp
+bool uring_available();
+void run_uring_loop(EventLoop *loop);
+// starts sending the client's output unless a send is in flight already
+void uring_flush(Client *client);
+// frees the client's slot once its operations in flight completed
+void uring_close(Client *client);
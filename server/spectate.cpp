@@ -0,0 +1,167 @@
+#include "server.h"
+
+// Clients watching a room, indexed by room id like the rooms. A slot is
+// emptied when its game ends and reused by the next room in it.
+struct Spectators {
+    pthread_mutex_t mutex;
+    int32_t *clients;
+    int32_t count;
+    int32_t capacity;
+};
+
+static SyncDynamicArray<Spectators> spectators;
+
+static Spectators *spectators_of(int32_t room_id) {
+    if(room_id >= __atomic_load_n(&spectators.size, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&spectators.mutex);
+        while(spectators.size <= room_id) spectators.push({});
+        pthread_mutex_unlock(&spectators.mutex);
+    }
+    return &spectators[room_id];
+}
+
+uint32_t spectate_stop(int client_index) {
+    Client *client = &clients[client_index];
+    // a room's actor only adds the client under connection.mutex and
+    // for the ticket it was asked with, either it did already or it won't.
+    // Events copied out for the old ticket aren't delivered from now on.
+    pthread_mutex_lock(&client->connection.mutex);
+    uint32_t ticket = ++client->spectate_ticket;
+    int32_t room_id = client->spectated_room;
+    pthread_mutex_unlock(&client->connection.mutex);
+    if(room_id == 0) return ticket;
+    Spectators *list = &spectators[room_id];
+    pthread_mutex_lock(&list->mutex);
+    // the game may have ended meanwhile
+    if(client->spectated_room == room_id) {
+        int32_t last = list->clients[--list->count];
+        list->clients[client->spectator_slot] = last;
+        clients[last].spectator_slot = client->spectator_slot;
+        client->spectated_room = 0;
+    }
+    pthread_mutex_unlock(&list->mutex);
+    return ticket;
+}
+
+void spectate_room(int client_index, uint32_t generation, int32_t room_id, uint32_t ticket) {
+    Client *client = &clients[client_index];
+    Response res = {};
+    res.type = RESPONSE_SPECTATE_SNAPSHOT;
+    // called by the room's actor, no move can be made meanwhile
+    GameData *game = &games[room_id];
+    bool open = room_id != 0 && rooms[room_id].player_a > 0;
+
+    bool added = false;
+    if(open) {
+        Spectators *list = spectators_of(room_id);
+        pthread_mutex_lock(&list->mutex);
+        pthread_mutex_lock(&client->connection.mutex);
+        if(client->slot.generation == generation && client->spectate_ticket == ticket &&
+           client->spectated_room == 0 && client->connection.desc > 0) {
+            if(list->count == list->capacity) {
+                list->capacity = list->capacity ? list->capacity * 2 : 64;
+                list->clients = (int32_t *)realloc(list->clients, list->capacity * sizeof(int32_t));
+                if(!list->clients) {
+                    printf("Error while growing the spectators to %d clients\n", list->capacity);
+                    exit(1);
+                }
+            }
+            client->spectated_room = room_id;
+            client->spectator_slot = list->count;
+            client->spectator_ticket = ticket;
+            list->clients[list->count++] = client_index;
+            added = true;
+        }
+        pthread_mutex_unlock(&client->connection.mutex);
+        pthread_mutex_unlock(&list->mutex);
+    }
+    if(!added) {
+        send_struct(client, generation, &res);
+        return;
+    }
+
+    // only the moves, the spectator replays them. Moves made later are
+    // sent by this actor too, they go out after the snapshot.
+    res.spectate.room_id = rooms[room_id].id;
+    res.spectate.board_size = (int8_t)game->board.size;
+    res.spectate.move_count = game->log.move_count;
+    static thread_local OutputBuffer snapshot;
+    snapshot.size = 0;
+    buffer_append(&snapshot, &res, sizeof(res));
+    buffer_append(&snapshot, game->log.moves, res.spectate.move_count * sizeof(v2_8));
+    client_send(client, generation, snapshot.data, snapshot.size);
+}
+
+void spectate_deliver(int loop, SharedMessage *message, uint8_t *spectators,
+                      int32_t count, bool flush) {
+    for(int32_t i = 0; i < count; i++) {
+        PostedSpectator spectator;
+        memcpy(&spectator, spectators + i * sizeof(spectator), sizeof(spectator));
+        Client *client = &clients[spectator.client_index];
+        pthread_mutex_lock(&client->connection.mutex);
+        // the client may have left since the event was copied out, or
+        // stopped watching, see spectate_stop
+        if(client->slot.generation == spectator.generation && client->connection.desc > 0 &&
+           client->spectate_ticket == spectator.ticket) {
+            if(!flush) client_queue(client, message->encoded.data, message->encoded.size);
+            else       client_flush(client);
+        }
+        pthread_mutex_unlock(&client->connection.mutex);
+    }
+}
+
+void spectate_publish(int32_t room_id, Response *event) {
+    if(room_id >= __atomic_load_n(&spectators.size, __ATOMIC_ACQUIRE)) return;
+    Spectators *list = &spectators[room_id];
+    if(__atomic_load_n(&list->count, __ATOMIC_RELAXED) == 0) return;
+
+    // encoded once for every spectator
+    SharedMessage *message = (SharedMessage *)calloc(1, sizeof(SharedMessage));
+    buffer_append(&message->encoded, event, sizeof(*event));
+    // the reference of this function
+    message->refs = 1;
+
+    // the spectators are copied out under the list's mutex and handed the
+    // event after, so a slow spectator doesn't hold up the room's actor
+    // with the mutex taken. Each loop gets the message followed by the
+    // spectators as PostedSpectator, with threads all of them are on
+    // loop 0.
+    static thread_local OutputBuffer mail[MAX_EVENT_LOOPS];
+    uint64_t loops_with_mail = 0;
+
+    pthread_mutex_lock(&list->mutex);
+    for(int32_t i = 0; i < list->count; i++) {
+        int32_t client_index = list->clients[i];
+        Client *client = &clients[client_index];
+        OutputBuffer *out = &mail[client->loop];
+        if(!(loops_with_mail & (1ull << client->loop))) {
+            loops_with_mail |= 1ull << client->loop;
+            out->size = 0;
+            buffer_append(out, &message, sizeof(message));
+        }
+        PostedSpectator spectator = {client_index, client->slot.generation, client->spectator_ticket};
+        buffer_append(out, &spectator, sizeof(spectator));
+    }
+    if(event->type == RESPONSE_SPECTATE_END) {
+        for(int32_t i = 0; i < list->count; i++)
+            clients[list->clients[i]].spectated_room = 0;
+        list->count = 0;
+    }
+    pthread_mutex_unlock(&list->mutex);
+
+    // posted before the next event of the room can be, so the moves
+    // arrive in order
+    for(int loop = 0; loops_with_mail; loop++) {
+        if(!(loops_with_mail & (1ull << loop))) continue;
+        loops_with_mail &= ~(1ull << loop);
+        __atomic_add_fetch(&message->refs, 1, __ATOMIC_RELAXED);
+        if(server_mode != SERVER_THREADS && post_spectator_event(loop, mail[loop].data, mail[loop].size))
+            continue;
+        int32_t count = (mail[loop].size - (int32_t)sizeof(message)) / (int32_t)sizeof(PostedSpectator);
+        uint8_t *spectators = mail[loop].data + sizeof(message);
+        spectate_deliver(loop, message, spectators, count, false);
+        spectate_deliver(loop, message, spectators, count, true);
+        shared_message_release(message);
+    }
+    shared_message_release(message);
+}
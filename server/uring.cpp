@@ -0,0 +1,389 @@
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server.h"
+
+#define RING_ENTRIES 1024
+
+// Receive buffers are provided to the kernel up front, each completed
+// receive says which one it filled and the buffer is provided again as soon
+// as its bytes are handled, so receives in flight don't pin memory
+#define PROVIDED_BUFFERS 1024
+#define PROVIDED_BUFFER_SIZE 2048
+#define PROVIDED_BUFFER_GROUP 0
+
+enum UringOperation {
+    URING_ACCEPT = 1,
+    URING_RECV,
+    URING_SEND,
+    URING_WAKEUP,
+    URING_PROVIDE,
+};
+
+// the operation in the top byte, the client index in the low bits
+#define USER_DATA(operation, client_index) (((uint64_t)(operation) << 56) | (uint32_t)(client_index))
+
+struct Uring {
+    int descriptor;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    io_uring_sqe *sqes;
+    // entries added to the submission queue since the last io_uring_enter
+    unsigned queued;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    uint8_t *buffer_memory;
+
+    // cleared when the kernel turns down multishot requests, they are
+    // then made again after every completion
+    bool multishot_accept;
+    bool multishot_recv;
+    // the eventfd of the loop's mailbox is read into it
+    uint64_t wakeups;
+};
+
+static int uring_setup(unsigned entries, io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int desc, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, desc, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void ring_free(Uring *ring) {
+    if(ring->buffer_memory) free(ring->buffer_memory);
+    if(ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if(ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+    if(ring->descriptor > 0) close(ring->descriptor);
+    *ring = {};
+}
+
+static bool ring_init(Uring *ring) {
+    *ring = {};
+    // completions are only processed when this thread asks for them, if
+    // the kernel is too old for that try with fewer flags
+    unsigned flag_sets[] = {
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+        0,
+    };
+    io_uring_params params;
+    for(unsigned flags : flag_sets) {
+        params = {};
+        params.flags = flags;
+        ring->descriptor = uring_setup(RING_ENTRIES, &params);
+        if(ring->descriptor >= 0 || errno != EINVAL) break;
+    }
+    if(ring->descriptor < 0) {
+        ring->descriptor = 0;
+        return false;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->descriptor, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED) { ring->sq_ring = 0; ring_free(ring); return false; }
+    ring->cq_ring = ring->sq_ring;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->descriptor, IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED) { ring->cq_ring = 0; ring_free(ring); return false; }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = (io_uring_sqe *)mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      ring->descriptor, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) { ring->sqes = 0; ring_free(ring); return false; }
+
+    uint8_t *sq = (uint8_t *)ring->sq_ring;
+    uint8_t *cq = (uint8_t *)ring->cq_ring;
+    ring->sq_head  = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_mask  = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head  = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask  = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ring->buffer_memory = (uint8_t *)malloc(PROVIDED_BUFFERS * PROVIDED_BUFFER_SIZE);
+    if(!ring->buffer_memory) { ring_free(ring); return false; }
+
+    ring->multishot_accept = true;
+    ring->multishot_recv = true;
+    return true;
+}
+
+bool uring_available() {
+    Uring ring;
+    bool available = ring_init(&ring);
+    if(available) ring_free(&ring);
+    return available;
+}
+
+static void submit(Uring *ring, unsigned wait_for) {
+    int submitted = uring_enter(ring->descriptor, ring->queued, wait_for,
+                                wait_for ? IORING_ENTER_GETEVENTS : 0);
+    count_syscalls(1);
+    if(submitted >= 0) {
+        ring->queued -= submitted;
+    } else if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        // EAGAIN and EBUSY only ask to reap completions first
+        fprintf(stderr, "Error in io_uring_enter: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// the entry is zeroed and only goes to the kernel with the next submit
+static io_uring_sqe *next_sqe(Uring *ring, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        submit(ring, 0);
+    }
+    io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return sqe;
+}
+
+// Buffer rings registered with IORING_REGISTER_PBUF_RING would save the
+// request, but receives from them fail with ENOBUFS on some kernels, so the
+// buffers are provided with requests that go out with the next submit.
+// Their completions are only posted on failure.
+static void provide_buffers(Uring *ring, int first_id, int count) {
+    io_uring_sqe *sqe = next_sqe(ring, USER_DATA(URING_PROVIDE, 0));
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd = count;
+    sqe->addr = (uint64_t)(ring->buffer_memory + first_id * PROVIDED_BUFFER_SIZE);
+    sqe->len = PROVIDED_BUFFER_SIZE;
+    sqe->buf_group = PROVIDED_BUFFER_GROUP;
+    sqe->off = first_id;
+}
+
+static void start_accept(EventLoop *loop) {
+    Uring *ring = loop->ring;
+    io_uring_sqe *sqe = next_sqe(ring, USER_DATA(URING_ACCEPT, 0));
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listening_descriptor;
+    if(ring->multishot_accept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void start_wakeup_read(EventLoop *loop) {
+    Uring *ring = loop->ring;
+    io_uring_sqe *sqe = next_sqe(ring, USER_DATA(URING_WAKEUP, 0));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wakeup_descriptor;
+    sqe->addr = (uint64_t)&ring->wakeups;
+    sqe->len = sizeof(ring->wakeups);
+}
+
+static void start_recv(Uring *ring, int client_index) {
+    Client *client = &clients[client_index];
+    io_uring_sqe *sqe = next_sqe(ring, USER_DATA(URING_RECV, client_index));
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->connection.desc;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = PROVIDED_BUFFER_GROUP;
+    if(ring->multishot_recv) sqe->ioprio = IORING_RECV_MULTISHOT;
+    else                     sqe->len = PROVIDED_BUFFER_SIZE;
+    client->receiving = true;
+}
+
+static void start_send(Uring *ring, int client_index) {
+    Client *client = &clients[client_index];
+    OutputBuffer *out = &client->sending;
+    io_uring_sqe *sqe = next_sqe(ring, USER_DATA(URING_SEND, client_index));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = client->connection.desc;
+    sqe->addr = (uint64_t)(out->data + out->sent);
+    sqe->len = out->size - out->sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    client->send_in_flight = true;
+}
+
+void uring_flush(Client *client) {
+    if(client->closing) {
+        client_discard_output(client);
+        return;
+    }
+    OutputBuffer *bulk = &client->bulk;
+    if(client->send_in_flight || client->output.size + bulk->size - bulk->sent == 0) return;
+
+    // the kernel reads from the sending buffer until the send completes,
+    // responses queued meanwhile go to the other one
+    OutputBuffer sending = client->sending;
+    client->sending = client->output;
+    client->output = sending;
+    client->output.size = client->output.sent = 0;
+
+    // sends take at most one bulk message after the output, so output
+    // queued meanwhile goes out before the next one
+    if(bulk->sent < bulk->size) {
+        int32_t *ends = (int32_t *)client->bulk_ends.data;
+        int32_t end = ends[0];
+        for(int32_t i = 0; end <= bulk->sent; i++) end = ends[i];
+        buffer_append(&client->sending, bulk->data + bulk->sent, end - bulk->sent);
+        bulk->sent = end;
+        if(bulk->sent == bulk->size) {
+            bulk->size = bulk->sent = 0;
+            client->bulk_ends.size = 0;
+        }
+    }
+    start_send(loops[client->loop].ring, (int)(client - &clients[0]));
+}
+
+void uring_close(Client *client) {
+    pthread_mutex_lock(&client->connection.mutex);
+    client->closing = true;
+    client_discard_output(client);
+    bool in_flight = client->receiving || client->send_in_flight;
+    if(in_flight) {
+        // ends the receive and the send, the last of them frees the slot
+        shutdown(client->connection.desc, SHUT_RDWR);
+        count_syscalls(1);
+    }
+    pthread_mutex_unlock(&client->connection.mutex);
+    if(!in_flight) client_release(client);
+}
+
+static void accepted(EventLoop *loop, io_uring_cqe *cqe) {
+    Uring *ring = loop->ring;
+    if(cqe->res >= 0) {
+        int client_index = client_open(cqe->res, loop->index);
+        printf("accepted connection %d on event loop %d\n", client_index, loop->index);
+        start_recv(ring, client_index);
+    } else if(cqe->res == -EINVAL && ring->multishot_accept) {
+        puts("multishot accept is not supported, accepting one connection at a time");
+        ring->multishot_accept = false;
+    } else {
+        fprintf(stderr, "Error while trying to accept an incoming connection: %s\n", strerror(-cqe->res));
+    }
+    if(!(cqe->flags & IORING_CQE_F_MORE)) start_accept(loop);
+}
+
+static void received(Uring *ring, int client_index, io_uring_cqe *cqe) {
+    Client *client = &clients[client_index];
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    if(!more) client->receiving = false;
+
+    bool open = !client->closing;
+    if(cqe->flags & IORING_CQE_F_BUFFER) {
+        int id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if(open && cqe->res > 0)
+            open = handle_received(client_index, ring->buffer_memory + id * PROVIDED_BUFFER_SIZE, cqe->res);
+        provide_buffers(ring, id, 1);
+    }
+
+    if(client->closing) {
+        if(!client->receiving && !client->send_in_flight) client_release(client);
+        return;
+    }
+
+    if(cqe->res == -EINVAL && ring->multishot_recv) {
+        puts("multishot receive is not supported, receiving one buffer at a time");
+        ring->multishot_recv = false;
+    } else if(cqe->res <= 0 && cqe->res != -ENOBUFS) {
+        // the client closed the connection or it broke
+        open = false;
+    }
+
+    if(!open) {
+        printf("closing connection %d\n", client_index);
+        client_close(client_index);
+    } else if(!client->receiving) {
+        // out of buffers or the kernel ended the multishot receive
+        start_recv(ring, client_index);
+    }
+}
+
+static void sent(Uring *ring, int client_index, io_uring_cqe *cqe) {
+    Client *client = &clients[client_index];
+    pthread_mutex_lock(&client->connection.mutex);
+    client->send_in_flight = false;
+    OutputBuffer *out = &client->sending;
+    if(cqe->res < 0) {
+        // the receive notices the broken connection and closes the client
+        if(!client->closing) {
+            shutdown(client->connection.desc, SHUT_RDWR);
+            count_syscalls(1);
+        }
+        out->size = out->sent = 0;
+    } else {
+        out->sent += cqe->res;
+        if(out->sent < out->size && !client->closing) {
+            start_send(ring, client_index);
+            pthread_mutex_unlock(&client->connection.mutex);
+            return;
+        }
+        out->size = out->sent = 0;
+    }
+    uring_flush(client);
+    bool release = client->closing && !client->receiving && !client->send_in_flight;
+    pthread_mutex_unlock(&client->connection.mutex);
+    if(release) client_release(client);
+}
+
+void run_uring_loop(EventLoop *loop) {
+    Uring *ring = (Uring *)calloc(1, sizeof(Uring));
+    if(!ring_init(ring)) {
+        fprintf(stderr, "Error while setting up io_uring for event loop %d: %s\n", loop->index, strerror(errno));
+        exit(1);
+    }
+    loop->ring = ring;
+    provide_buffers(ring, 0, PROVIDED_BUFFERS);
+    start_accept(loop);
+    start_wakeup_read(loop);
+
+    while(1) {
+        submit(ring, 1);
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) {
+            io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+            // hand the entry back right away, handling it can take long
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+            int client_index = (int)(uint32_t)cqe.user_data;
+            switch(cqe.user_data >> 56) {
+                case URING_ACCEPT: accepted(loop, &cqe); break;
+                case URING_RECV:   received(ring, client_index, &cqe); break;
+                case URING_SEND:   sent(ring, client_index, &cqe); break;
+                case URING_WAKEUP: {
+                    deliver_mail(loop);
+                    start_wakeup_read(loop);
+                } break;
+                case URING_PROVIDE: {
+                    fprintf(stderr, "Error while providing receive buffers: %s\n", strerror(-cqe.res));
+                } break;
+            }
+        }
+    }
+}